@@ -0,0 +1,50 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "cinder/Exception.h"
+#include "cinder/Filesystem.h"
+
+//! Bpm values of all metronomes over time. Stored as text, one field per line as
+//! "time bpm0 bpm1 ... bpmN-1" with the time in seconds from the start, lines
+//! starting with '#' are comments. Fields are kept in the order of their times.
+class BpmTimeline
+{
+ public:
+	struct Field
+	{
+		double mTime;
+		std::vector< int > mBpm;
+	};
+
+	//! Appends a field, \a time has to be at or after the time of the last one.
+	void addField( double time, const std::vector< int > &bpm );
+	void clear() { mFields.clear(); }
+
+	const std::vector< Field > & getFields() const { return mFields; }
+	bool isEmpty() const { return mFields.empty(); }
+	//! Time of the last field in seconds.
+	double getDuration() const { return mFields.empty() ? 0.0 : mFields.back().mTime; }
+	//! Largest number of bpm values in a field.
+	size_t getNumVoices() const;
+
+	//! Throws ExcBpmTimeline if the file cannot be read or a line is invalid.
+	static BpmTimeline read( const ci::fs::path &path );
+	//! Throws ExcBpmTimeline if the file cannot be written.
+	void write( const ci::fs::path &path ) const;
+
+	//! Random walk of \a numVoices metronomes between 40 and 220 bpm for \a duration seconds,
+	//! with \a fieldRate fields per second. The same \a seed gives the same timeline.
+	static BpmTimeline generate( size_t numVoices, double duration, double fieldRate = 10.0, uint32_t seed = 1 );
+
+ protected:
+	std::vector< Field > mFields;
+};
+
+class ExcBpmTimeline : public ci::Exception
+{
+ public:
+	ExcBpmTimeline( const std::string &description ) : ci::Exception( description ) {}
+};
@@ -1,8 +1,12 @@
 #pragma once
 
+#include <array>
+#include <bitset>
 #include <memory>
+#include <mutex>
 
 #include "cinder/Rect.h"
+#include "cinder/gl/VertBatch.h"
 #include "cinder/params/Params.h"
 
 #include "mndl/blobtracker/BlobTracker.h"
@@ -16,12 +20,52 @@ class CellDetector
 
 	void resize( const ci::Rectf &bounds );
 
-	void update( const std::vector< mndl::blobtracker::BlobRef > &blobs );
+	//! Hands the values edited in the params or read from the config over to update(). Called from the ui thread.
+	void commitParams();
+	//! Takes over the values of the last commitParams(). Called from the thread of update() before updating.
+	void applyParams();
+
+	//! Sets the resolution of the cell label map, usually the tracking resolution.
+	void setFrameSize( const ci::ivec2 &size ) { mFrameSize = size; }
+
+	//! Updates the cell coordinates if \a blobsGeneration or the grid has changed since the last update.
+	//! Blob positions are normalized to \a normalizedBlobArea of the tracked frame.
+	//! Can be called from a different thread than draw().
+	void update( const std::vector< mndl::blobtracker::BlobRef > &blobs, uint64_t blobsGeneration,
+				 const ci::Rectf &normalizedBlobArea = ci::Rectf( 0.0f, 0.0f, 1.0f, 1.0f ) );
+	//! Updates the cell coordinates from the foreground pixels of \a channel if \a channelGeneration or
+	//! the grid has changed. Pixels above \a threshold are foreground, or below if \a thresholdInverts.
+	//! \a channel has to be the size of the frame, mirrored horizontally if \a flip.
+	void update( const ci::Channel8u &channel, uint8_t threshold, bool thresholdInverts, bool flip,
+				 uint64_t channelGeneration );
+	//! Draws the last published state, see update().
 	void draw();
 
 	// Returns blobs cell coordinates in grid.
 	const std::vector< ci::ivec2 > & getBlobCellCoords() const { return mBlobCellCoords; }
 
+	static const size_t kMaxGridSize = 32;
+	//! Occupied cells, the cell at ( x, y ) is bit y * gridSize + x. Grids larger than kMaxGridSize only set their first bits.
+	typedef std::bitset< kMaxGridSize * kMaxGridSize > Occupancy;
+	//! Returns the occupied cells, which change together with getBlobCellCoords().
+	const Occupancy & getOccupancy() const { return mOccupancy; }
+
+	//! Returns the generation of the cell coordinates, which is increased every time they change.
+	uint64_t getGeneration() const { return mGeneration; }
+
+	enum class DetectionMode : int
+	{
+		//! cells containing the center of a tracked blob are occupied
+		BLOB_CENTERS = 0,
+		//! cells with foreground pixels covering at least the min coverage are occupied
+		PIXEL_COVERAGE
+	};
+	DetectionMode getDetectionMode() const { return mDetectionMode; }
+
+	//! Returns the normalized bounding rectangle of the grid.
+	ci::Rectf getNormalizedGridBounds() const;
+
+	//! Returns the screen position of the cell center in the last published state.
 	ci::vec2 getCellCenter( const ci::ivec2 &cellPos );
 
  protected:
@@ -32,11 +76,101 @@ class CellDetector
 	void setupParams();
 
 	ci::Rectf mNormalizedGridArea;
+	//! With perspective enabled the grid is spanned by four normalized corners
+	//! in top left, top right, bottom right, bottom left order instead of the grid area.
+	bool mPerspectiveEnabled = false;
+	std::array< ci::vec2, 4 > mNormalizedGridCorners;
+	ci::Rectf mScreenBounds;
 	ci::RectMapping mNormalizedToScreenMapping;
 
+	//! Returns the corners of the grid in use.
+	std::array< ci::vec2, 4 > getGridCorners() const;
+
+	DetectionMode mDetectionMode = DetectionMode::BLOB_CENTERS;
+	float mMinCoverage = 0.25f;
+	DetectionMode mLastDetectionMode = DetectionMode::BLOB_CENTERS;
+	float mLastMinCoverage = 0.0f;
+
+	//! Recalculates the grid if needed. Returns true if the grid or the detection settings have changed.
+	bool updateGrid();
+	//! Applies the hysteresis to mRawCellCounts. Increases the generation and publishes the
+	//! draw state if the cells have changed.
+	void finishUpdate( bool gridChanged, bool newInput );
+
+	//! Changes of the cells have to persist for the enter or exit delay, given in input frames or milliseconds.
+	enum class HysteresisUnit : int
+	{
+		FRAMES = 0,
+		MILLISECONDS
+	};
+	HysteresisUnit mHysteresisUnit = HysteresisUnit::FRAMES;
+	int mEnterDelay = 0;
+	int mExitDelay = 0;
+
+	//! Values of the params, edited on the ui thread while update() works on the members taken over in applyParams().
+	struct Settings
+	{
+		ci::Rectf mNormalizedGridArea = ci::Rectf( 0.0f, 0.0f, 1.0f, 1.0f );
+		bool mPerspectiveEnabled = false;
+		std::array< ci::vec2, 4 > mNormalizedGridCorners;
+		DetectionMode mDetectionMode = DetectionMode::BLOB_CENTERS;
+		float mMinCoverage = 0.25f;
+		HysteresisUnit mHysteresisUnit = HysteresisUnit::FRAMES;
+		int mEnterDelay = 0;
+		int mExitDelay = 0;
+	};
+	Settings mParamSettings; // bound to the params and the config
+	Settings mPendingSettings; // last committed values, guarded by mSettingsMutex
+	std::mutex mSettingsMutex;
+
+	struct CellState
+	{
+		uint16_t mCount = 0; // number of blobs accepted in the cell
+		int mPendingFrames = 0; // input frames since the detected count differs
+		double mPendingSince = -1.0; // time since the detected count differs, negative if it does not
+	};
+	std::vector< CellState > mCellStates;
+	//! Number of blobs detected in each cell by the last input.
+	std::vector< uint16_t > mRawCellCounts;
+	size_t mNumPendingCells = 0;
+
 	void calcGridCells();
-	std::vector< std::vector< ci::Rectf > > mGridCells;
+	//! Returns the index of the cell containing the normalized \a pos or -1 if it is outside of the grid.
+	int getCellIndex( const ci::vec2 &pos ) const;
 	size_t mLastGridSize = 0;
+	std::array< ci::vec2, 4 > mLastGridCorners;
+	ci::ivec2 mFrameSize = ci::ivec2( 640, 480 );
+	ci::ivec2 mLastFrameSize;
+	//! Maps the unit square of the grid to the normalized frame.
+	ci::mat3 mGridToFrame;
+
+	//! Cell index of every pixel of the frame in row-major order, the number of cells outside of the grid.
+	std::vector< uint16_t > mCellLabels;
+	//! Number of pixels per cell in the label map.
+	std::vector< uint32_t > mCellPixelCounts;
+	std::vector< uint32_t > mCellCounts;
+	//! Grid line intersections in normalized frame coordinates, ( mLastGridSize + 1 )^2 points in row-major order.
+	std::vector< ci::vec2 > mGridPoints;
 
 	std::vector< ci::ivec2 > mBlobCellCoords;
+	Occupancy mOccupancy;
+	uint64_t mLastInputGeneration = 0;
+	uint64_t mGeneration = 0;
+
+	//! Immutable copy of the grid and the cell coordinates for drawing, replaced atomically when either changes.
+	struct DrawState
+	{
+		size_t mGridSize = 0;
+		std::vector< ci::vec2 > mGridPoints;
+		std::vector< ci::ivec2 > mBlobCellCoords;
+	};
+	typedef std::shared_ptr< const DrawState > DrawStateRef;
+	DrawStateRef mDrawState;
+
+	void publishDrawState();
+
+	// batches of the grid and the occupied cells in normalized coordinates, rebuilt when the draw state changes
+	DrawStateRef mBatchState;
+	ci::gl::VertBatchRef mGridBatch;
+	ci::gl::VertBatchRef mCellsBatch;
 };
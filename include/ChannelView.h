@@ -1,5 +1,11 @@
 #pragma once
 
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
 #include "cinder/CinderResources.h"
 #include "cinder/gl/Texture.h"
 #include "cinder/Surface.h"
@@ -8,6 +14,7 @@
 #include "cinder/Rand.h"
 #include "cinder/params/Params.h"
 #include "Resources.h"
+#include "CellDetector.h"
 
 class ChannelView {
 public:
@@ -15,23 +22,46 @@ public:
     ChannelView();
     
     void setup();
+    //! Hands the values edited in the params or read from the config over to update(). Called from the ui thread.
+    void commitParams();
+    //! Takes over the values of the last commitParams(). Called from the thread of update() before updating.
+    void applyParams();
 	//! Updates the blob grid coordinates in \a cps. Each blob position is sent as an integer coordinate in the grid.
-	void update(const std::vector<ci::ivec2> &cps);
+	//! The channels are only recalculated if \a cpsGeneration or the bpm values have changed since the last update.
+	//! \a occupancy holds the cells of \a cps, recently seen occupancies are served from a cache.
+	void update(const std::vector<ci::ivec2> &cps, uint64_t cpsGeneration, const CellDetector::Occupancy &occupancy);
+	//! Returns the generation of the result channels, which is increased every time they are recalculated.
+	uint64_t getGeneration() const { return mGeneration; }
+
+	//! Integer values of the result channels in row-major order, immutable once published by update().
+	struct Result {
+		std::vector< int > mRaw; // base channel divided by 10
+		std::vector< int > mBpm;
+		std::vector< int > mBpmEven; // values at even indices of mBpm
+		std::vector< int > mBpmOdd; // values at odd indices of mBpm
+		ci::ivec2 mSize; // of the field
+		//! The generation the values were computed in.
+		uint64_t mVersion = 0;
+	};
+	typedef std::shared_ptr< const Result > ResultRef;
+	//! Returns the result of the last update. Holding the reference keeps the values alive and unchanged.
+	//! References have to be copied and released on the thread of update(), other threads read the
+	//! values through a holder that is handed back to that thread, like the app's pipeline snapshots.
+	const ResultRef & getResult() const { return mResult; }
     
     ci::Rand rnd;
     
     std::string getRawResultAsString();
     std::string getBpmResultAsString();
-    std::vector< int > getRawResultAsVector();
-    std::vector< int > getBpmResultAsVector();
+    const std::vector< int > & getRawResultAsVector() const { return mResult->mRaw; }
+    const std::vector< int > & getBpmResultAsVector() const { return mResult->mBpm; }
     std::vector< std::string > getBpmResultAsMultiString();
-    std::vector< int > getBpmResultAsVectorEven();
-    std::vector< int > getBpmResultAsVectorOdd();
+    const std::vector< int > & getBpmResultAsVectorEven() const { return mResult->mBpmEven; }
+    const std::vector< int > & getBpmResultAsVectorOdd() const { return mResult->mBpmOdd; }
     std::vector< std::string > getBpmResultAsFixedMultiString();
     
     ci::Channel32f baseChannel;
     ci::Channel32f bpmChannel;
-    ci::Channel customChannel;
     
     std::vector<ci::ivec2> controlPoints;
     std::vector<float> baseColors;
@@ -45,4 +75,100 @@ public:
     ci::params::InterfaceGlRef mParams;
     
     std::vector< int > mBpmValues = { 60, 70, 80, 90, 100, 110, 120, 130, 140, 150, 160, 170, 180, 190, 200, 210, 220  }; 
+
+protected:
+    //! Values of the params, edited on the ui thread while update() works on the members taken over in applyParams().
+    struct Settings {
+        std::vector< int > mBpmValues;
+        int mPatternId = 0;
+        float mPatternCrossfade = 2.0f;
+        int mFieldCacheCapacity = 64;
+        bool mIncrementalEnabled = true;
+        bool mVerifyEnabled = false;
+    };
+    Settings mParamSettings; // bound to the params and the config
+    Settings mPendingSettings; // last committed values, guarded by mSettingsMutex
+    std::mutex mSettingsMutex;
+
+    //! Each pattern image is baked at startup into a flat stamp of raw weights, indices into
+    //! mBpmValues and bpm contributions, the latter are rebaked when the bpm values change.
+    struct Stamp {
+        std::string mName;
+        ci::ivec2 mSize;
+        //! Pixel of the stamp placed on the control point.
+        ci::ivec2 mCenter;
+        std::vector< float > mRaw;
+        std::vector< int8_t > mBpmIndex; // -1 if the pixel does not contribute
+        std::vector< float > mBpm;
+    };
+    std::vector< Stamp > mStamps;
+    std::vector< std::string > mPatternNames;
+    void loadStamp( const std::string &name, const ci::DataSourceRef &source );
+    void bakeStamps();
+
+    //! Unclamped sums of the stamps of one pattern at mStampedPoints, the channels are derived from these.
+    struct FieldSums {
+        std::vector< float > mRaw;
+        std::vector< float > mBpm;
+        bool mValid = false;
+    };
+    //! Adds \a stamp centered on control point \a tp multiplied by \a weight to \a sums.
+    void accumulateStamp( const Stamp &stamp, const ci::ivec2 &tp, float weight, FieldSums *sums );
+
+    std::vector< ci::ivec2 > mStampedPoints;
+    void recomputeSums( const Stamp &stamp, const std::vector< ci::ivec2 > &cps, FieldSums *sums );
+    //! Finds the points that left and entered since the last update in mRemovedPoints and mAddedPoints.
+    void diffControlPoints( const std::vector< ci::ivec2 > &cps );
+    //! Only removes the stamps of the points that left and adds the ones of the points that entered if \a sums are valid.
+    void updateSums( const Stamp &stamp, const std::vector< ci::ivec2 > &cps, FieldSums *sums );
+    bool mIncrementalEnabled = true;
+    std::vector< ci::ivec2 > mSortedPoints;
+    std::vector< ci::ivec2 > mSortedStampedPoints;
+    std::vector< ci::ivec2 > mAddedPoints;
+    std::vector< ci::ivec2 > mRemovedPoints;
+
+    //! Compares \a sums to a full recompute and replaces them if they differ.
+    void verifySums( const Stamp &stamp, const std::vector< ci::ivec2 > &cps, FieldSums *sums );
+    bool mVerifyEnabled = false;
+    int mVerifyFailures = 0;
+    FieldSums mVerifySums;
+
+    //! Sums of the active pattern and of the pattern faded to during a crossfade.
+    FieldSums mSums;
+    FieldSums mFadeSums;
+    int mPatternId = 0; // requested from the params
+    int mActivePattern = 0;
+    int mFadePattern = -1; // -1 if not fading
+    float mPatternCrossfade = 2.0f; // seconds
+    double mFadeStart = 0.0;
+    float mFadeAmount = 0.0f;
+    //! Starts or advances the crossfade to the requested pattern. Returns true if the field has changed.
+    bool updatePattern();
+    void finishFade();
+
+    //! Field sums of the active pattern computed for an occupancy, kept in least recently used order.
+    struct FieldCacheEntry {
+        CellDetector::Occupancy mOccupancy;
+        FieldSums mSums;
+    };
+    typedef std::list< FieldCacheEntry > FieldCache;
+    FieldCache mFieldCache; // most recently used first
+    std::unordered_map< CellDetector::Occupancy, FieldCache::iterator > mFieldCacheIndex;
+    int mFieldCacheCapacity = 64;
+    int mFieldCacheHits = 0;
+    int mFieldCacheMisses = 0;
+    bool lookupFieldCache( const CellDetector::Occupancy &occupancy );
+    void storeFieldCache( const CellDetector::Occupancy &occupancy );
+    void clearFieldCache();
+
+    bool mBpmValuesChanged = true;
+    uint64_t mLastCpsGeneration = 0;
+    uint64_t mGeneration = 0;
+
+    //! Fills a result that is not referenced outside of the pool from the channels and publishes it.
+    void publishResult();
+    // results are recycled once only the pool references them, so their arrays keep their capacity. The
+    // use count is exact as all references are copied and dropped on the thread of update().
+    std::vector< std::shared_ptr< Result > > mResultPool;
+    ResultRef mResult;
 };
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+//! Plays preloaded click samples at the tick positions of every metronome voice.
+//! Ticks are scheduled from the shared start time and the period of the voice, so a
+//! voice ticks exactly at start + k * period samples whenever its tempo is set. The
+//! work per block depends on the number of ticks instead of the number of voices.
+//! Voice i plays to output channel i % numChannels. Not thread-safe.
+class ClickEngine
+{
+ public:
+	//! Allocates the voices and renders the click bank for \a sampleRate. Ticks start at sample 0.
+	void setup( size_t numVoices, float sampleRate, size_t numChannels = 1 );
+
+	//! Sets the beat frequency of voice \a i in Hz and the center frequency of its click.
+	//! A beat frequency of 0 silences the voice.
+	void setVoice( size_t i, float freq, float centerFreq );
+	//! Changes the beat frequency of voice \a i without moving it to the grid of the start time,
+	//! its next tick follows the last one by the new period.
+	void bendVoice( size_t i, float freq );
+	//! Sets the gain of the clicks of voice \a i starting from its next tick.
+	void setVoiceGain( size_t i, float gain ) { mVoiceGain[ i ] = gain; }
+	//! Makes \a sampleTime the shared start time, the next tick of every voice is scheduled from there.
+	void restart( uint64_t sampleTime );
+
+	//! Adds the clicks of the next \a numFrames samples multiplied by \a gain to the output \a channels.
+	void process( float *const *channels, size_t numFrames, float gain );
+	//! Moves on by \a numFrames samples without playing, the voices keep their tick positions.
+	void advance( size_t numFrames );
+
+	uint64_t getSampleTime() const { return mSampleTime; }
+	//! Number of ticks skipped because too many clicks were playing.
+	uint64_t getNumDroppedClicks() const { return mNumDroppedClicks; }
+
+ protected:
+	//! Renders the clicks, each is the ring of a band-pass with Q \a q after a phasor reset.
+	void renderBank( float q );
+	//! Returns the click closest to \a centerFreq.
+	uint16_t getClickIndex( float centerFreq ) const;
+	void scheduleNextTick( size_t i );
+
+	float mSampleRate = 44100.0f;
+	size_t mNumChannels = 1;
+	uint64_t mSampleTime = 0; // of the next block
+	uint64_t mStartTime = 0;
+
+	//! Clicks at semitone steps from kMinCenterFreq, stored back to back in mBankSamples.
+	static constexpr float kMinCenterFreq = 200.0f;
+	std::vector< float > mBankSamples;
+	std::vector< uint32_t > mBankOffsets;
+	std::vector< uint32_t > mBankLengths;
+
+	// voice state
+	std::vector< double > mPeriod; // in samples, 0 if silent
+	std::vector< double > mNextTick; // in samples
+	std::vector< uint16_t > mClickIndex;
+	std::vector< float > mVoiceGain;
+
+	struct PlayingClick
+	{
+		uint32_t mOffset; // of the next sample in mBankSamples
+		uint32_t mRemaining;
+		uint32_t mDelay; // frames of the block before the click starts
+		uint32_t mChannel;
+		float mGain;
+	};
+	//! Preallocated for two overlapping clicks per voice, ticks beyond that are dropped.
+	std::vector< PlayingClick > mPlayingClicks;
+	size_t mNumPlayingClicks = 0;
+	uint64_t mNumDroppedClicks = 0;
+};
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "cinder/Channel.h"
+#include "cinder/Filesystem.h"
+
+#include "DepthRecording.h"
+
+typedef std::shared_ptr< class DepthPlayer > DepthPlayerRef;
+
+//! Replays depth recordings from a memory-mapped file. Raw frames are
+//! handed out as channels pointing into the mapping, without copying,
+//! compressed frames are decoded into a buffer per camera. Cameras recorded
+//! with 16-bit depth are segmented with the replay depth band.
+class DepthPlayer
+{
+ public:
+	//! Maps the recording at \a path. Throws depthrecording::ExcDepthRecording on failure.
+	static DepthPlayerRef create( const ci::fs::path &path ) { return DepthPlayerRef( new DepthPlayer( path ) ); }
+	~DepthPlayer();
+
+	struct Frame
+	{
+		ci::ChannelRef mChannel;
+		uint64_t mSequence = 0;
+		double mTimestamp = 0.0;
+		//! The channel holds the binary foreground mask of the depth band instead of the inverted depth.
+		bool mDepthBand = false;
+	};
+
+	//! In realtime mode frames follow the recorded timestamps, otherwise each
+	//! update() advances by one frame per camera.
+	void setRealtime( bool realtime ) { mRealtime = realtime; }
+	bool isRealtime() const { return mRealtime; }
+
+	//! Sets the depth band in millimetres the 16-bit cameras are segmented with. Returns true if the
+	//! band has changed and the current frames of these cameras have been segmented again.
+	bool setDepthBand( uint16_t nearMm, uint16_t farMm );
+
+	//! Advances the playback to \a time in seconds, looping at the end. Returns
+	//! true if any camera received a new frame.
+	bool update( double time );
+
+	//! Positions the playback to \a recordingTime seconds from the start of the recording.
+	void seek( double recordingTime );
+
+	size_t getNumCameras() const { return mFrames.size(); }
+	const Frame & getFrame( size_t cameraId ) const { return mFrames[ cameraId ]; }
+	std::string getCameraLabel( size_t cameraId ) const;
+
+	uint64_t getNumFrames() const { return mNumFrames; }
+	double getDuration() const;
+	//! Returns the recording time of the last frame played.
+	double getPosition() const { return mPosition; }
+
+ protected:
+	DepthPlayer( const ci::fs::path &path );
+
+	void playFrame( size_t frameId );
+
+	int mFd = -1;
+	uint8_t *mData = nullptr;
+	size_t mSize = 0;
+
+	const depthrecording::CameraInfo *mCameras = nullptr;
+	const depthrecording::IndexEntry *mIndex = nullptr;
+	uint64_t mNumFrames = 0;
+
+	std::vector< Frame > mFrames;
+	std::vector< std::vector< uint8_t > > mDecodeBuffers;
+	std::vector< ci::Channel16u > mDepthChannels; // latest depth of the 16-bit cameras, points into the mapping or the decode buffer
+	uint16_t mDepthNear = 500;
+	uint16_t mDepthFar = 4000;
+
+	bool mRealtime = true;
+	size_t mNextFrameId = 0;
+	double mPosition = 0.0;
+	double mStartTime = -1.0; // playback time of the first frame, negative if not started yet
+	std::vector< bool > mCameraUpdated;
+};
@@ -0,0 +1,93 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "cinder/Channel.h"
+#include "cinder/Filesystem.h"
+
+#include "DepthRecording.h"
+#include "SpscQueue.h"
+
+typedef std::shared_ptr< class DepthRecorder > DepthRecorderRef;
+
+//! Records live depth frames with ENCODING_DELTA_RLE on a background writer
+//! thread. Each camera has its own bounded queue of preallocated frame
+//! buffers, so a capture thread only copies the pixels and never waits for
+//! the disk. Frames are dropped and counted if the writer falls behind.
+//! Cameras with PIXEL_FORMAT_DEPTH16 take 16-bit frames, the others 8-bit ones.
+class DepthRecorder
+{
+ public:
+	//! Creates the recording at \a path and starts the writer thread. Throws depthrecording::ExcDepthRecording on failure.
+	static DepthRecorderRef create( const ci::fs::path &path, const std::vector< DepthRecordingWriter::Camera > &cameras )
+	{ return DepthRecorderRef( new DepthRecorder( path, cameras ) ); }
+	~DepthRecorder();
+
+	//! Queues a copy of \a channel. Must only be called from one thread per camera. Returns false if the frame was dropped.
+	bool addFrame( size_t cameraId, uint64_t sequence, double timestamp, const ci::Channel8u &channel );
+	bool addFrame( size_t cameraId, uint64_t sequence, double timestamp, const ci::Channel16u &channel );
+
+	//! Writes the queued frames, finishes the file and stops the writer thread.
+	void stop();
+	bool isRunning() const { return mRunning; }
+
+	struct Stats
+	{
+		uint64_t mNumFrames = 0;
+		uint64_t mNumDroppedFrames = 0;
+		uint64_t mRawBytes = 0;
+		uint64_t mEncodedBytes = 0;
+		double mElapsedSeconds = 0.0;
+
+		//! Encoded bytes written per second in megabytes.
+		double getThroughput() const { return ( mElapsedSeconds > 0.0 ) ? mEncodedBytes / ( mElapsedSeconds * 1024.0 * 1024.0 ) : 0.0; }
+		double getCompressionRatio() const { return mEncodedBytes ? double( mRawBytes ) / mEncodedBytes : 0.0; }
+	};
+	Stats getStats() const;
+
+ protected:
+	DepthRecorder( const ci::fs::path &path, const std::vector< DepthRecordingWriter::Camera > &cameras );
+
+	void writerThreadFn();
+	void writeFrame( size_t cameraId, size_t frameId );
+
+	struct Frame
+	{
+		ci::Channel8u mChannel; // allocated for 8-bit cameras only
+		ci::Channel16u mDepth; // allocated for 16-bit cameras only
+		uint64_t mSequence = 0;
+		double mTimestamp = 0.0;
+	};
+
+	//! Frames move from \a mFreeFrames to \a mQueuedFrames in the capture thread and back in the writer thread.
+	struct CameraQueue
+	{
+		CameraQueue( const DepthRecordingWriter::Camera &camera );
+
+		static const size_t kNumFrames = 16;
+		std::vector< Frame > mFrames;
+		mndl::SpscQueue< size_t > mFreeFrames;
+		mndl::SpscQueue< size_t > mQueuedFrames;
+		std::atomic< uint64_t > mNumDroppedFrames;
+		bool mDepth16;
+	};
+	std::vector< std::unique_ptr< CameraQueue > > mCameraQueues;
+
+	template< typename T >
+	bool addChannelFrame( size_t cameraId, uint64_t sequence, double timestamp, const ci::ChannelT< T > &channel,
+						  ci::ChannelT< T > Frame::*frameChannel );
+
+	DepthRecordingWriterRef mWriter;
+	std::shared_ptr< std::thread > mWriterThread;
+	std::atomic< bool > mRunning;
+
+	std::chrono::steady_clock::time_point mStartTime;
+	std::atomic< double > mElapsedSeconds; // updated by the writer thread
+	std::atomic< uint64_t > mNumFrames;
+	std::atomic< uint64_t > mRawBytes;
+	std::atomic< uint64_t > mEncodedBytes;
+};
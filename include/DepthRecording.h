@@ -0,0 +1,164 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "cinder/Channel.h"
+#include "cinder/Exception.h"
+#include "cinder/Filesystem.h"
+
+//! On-disk layout of multi-camera depth recordings. All fields are stored in
+//! host (little-endian) byte order:
+//!
+//!   FileHeader
+//!   CameraInfo[ numCameras ]
+//!   { FrameHeader, frame data padded to 8 bytes }[ numFrames ]
+//!   IndexEntry[ numFrames ] at FileHeader::mIndexOffset
+//!
+//! The index is ordered by capture time. Raw frames are stored row by row
+//! without padding, so they can be used in place from a memory-mapped file.
+//! Delta-RLE frames store the difference of each pixel to its left
+//! neighbour (the first pixel of a row to 0), PackBits-coded over the whole
+//! frame: a control byte c < 128 is followed by c + 1 literal bytes, c >= 128
+//! by a single byte repeated c - 126 times. Cameras with PIXEL_FORMAT_DEPTH16
+//! store raw depth in millimetres, their deltas are coded as little-endian
+//! byte pairs.
+namespace depthrecording
+{
+
+static const char kMagic[ 8 ] = { 'M', 'T', 'R', 'D', 'E', 'P', 'T', 'H' };
+static const uint32_t kVersion = 1;
+
+//! Largest depth resolution of the supported OpenNI sensors, recordings with larger cameras are rejected.
+static const int32_t kMaxFrameWidth = 1280;
+static const int32_t kMaxFrameHeight = 1024;
+
+enum Encoding : uint32_t
+{
+	ENCODING_RAW = 0,
+	ENCODING_DELTA_RLE
+};
+
+enum PixelFormat : uint32_t
+{
+	PIXEL_FORMAT_DEPTH8 = 0, // inverted depth, 8-bit
+	PIXEL_FORMAT_DEPTH16 // depth in millimetres, 16-bit
+};
+
+struct FileHeader
+{
+	char mMagic[ 8 ];
+	uint32_t mVersion;
+	uint32_t mNumCameras;
+	uint64_t mNumFrames;
+	uint64_t mIndexOffset; // 0 if the recording was not finished
+};
+
+struct CameraInfo
+{
+	int32_t mWidth;
+	int32_t mHeight;
+	uint32_t mBytesPerPixel;
+	uint32_t mPixelFormat; // 0 in recordings written before 16-bit cameras were supported
+	char mLabel[ 64 ];
+};
+
+struct FrameHeader
+{
+	uint32_t mCameraId;
+	uint32_t mEncoding;
+	uint64_t mSequence;
+	double mTimestamp; // seconds
+	uint64_t mDataSize; // without padding
+};
+
+struct IndexEntry
+{
+	uint64_t mOffset; // of the FrameHeader from the beginning of the file
+	double mTimestamp;
+	uint32_t mCameraId;
+	uint32_t mReserved;
+};
+
+static_assert( sizeof( FileHeader ) == 32, "unexpected FileHeader size" );
+static_assert( sizeof( CameraInfo ) == 80, "unexpected CameraInfo size" );
+static_assert( sizeof( FrameHeader ) == 32, "unexpected FrameHeader size" );
+static_assert( sizeof( IndexEntry ) == 24, "unexpected IndexEntry size" );
+
+inline uint64_t paddedSize( uint64_t size ) { return ( size + 7 ) & ~uint64_t( 7 ); }
+
+//! Encodes \a channel with ENCODING_DELTA_RLE into \a output, which is resized to the encoded size.
+void encodeDeltaRle( const ci::Channel8u &channel, std::vector< uint8_t > *output );
+void encodeDeltaRle( const ci::Channel16u &channel, std::vector< uint8_t > *output );
+//! Decodes ENCODING_DELTA_RLE \a data into the tightly packed \a width x \a height pixels of \a output.
+//! Returns false if the data is corrupt.
+bool decodeDeltaRle( const uint8_t *data, size_t dataSize, int32_t width, int32_t height, uint8_t *output );
+bool decodeDeltaRle( const uint8_t *data, size_t dataSize, int32_t width, int32_t height, uint16_t *output );
+
+//! Writes 255 to \a mask where \a depth is within [ \a nearMm, \a farMm ] and 0 elsewhere in a single pass.
+//! Invalid zero depth values are always outside of the band. Segments live frames and replayed 16-bit recordings.
+void depthBandMask( const ci::Channel16u &depth, uint16_t nearMm, uint16_t farMm, ci::Channel8u *mask );
+
+class ExcDepthRecording : public ci::Exception
+{
+ public:
+	ExcDepthRecording( const std::string &description ) : ci::Exception( description ) {}
+};
+
+} // namespace depthrecording
+
+typedef std::shared_ptr< class DepthRecordingWriter > DepthRecordingWriterRef;
+
+//! Writes frames of 8-bit or 16-bit depth channels to a recording file.
+class DepthRecordingWriter
+{
+ public:
+	struct Camera
+	{
+		ci::ivec2 mSize;
+		std::string mLabel;
+		depthrecording::PixelFormat mPixelFormat; // PIXEL_FORMAT_DEPTH8 if omitted from the initializer list
+	};
+
+	//! Creates the file at \a path. Throws depthrecording::ExcDepthRecording on failure.
+	static DepthRecordingWriterRef create( const ci::fs::path &path, const std::vector< Camera > &cameras )
+	{ return DepthRecordingWriterRef( new DepthRecordingWriter( path, cameras ) ); }
+	//! Finishes the recording if it has not been finished yet.
+	~DepthRecordingWriter();
+
+	//! Appends a frame of camera \a cameraId. The channel size and pixel format have to match the camera given at creation.
+	void addFrame( uint32_t cameraId, uint64_t sequence, double timestamp, const ci::Channel8u &channel );
+	void addFrame( uint32_t cameraId, uint64_t sequence, double timestamp, const ci::Channel16u &channel );
+	//! Appends a frame of camera \a cameraId compressed with ENCODING_DELTA_RLE.
+	void addCompressedFrame( uint32_t cameraId, uint64_t sequence, double timestamp, const ci::Channel8u &channel );
+	void addCompressedFrame( uint32_t cameraId, uint64_t sequence, double timestamp, const ci::Channel16u &channel );
+	//! Appends already encoded frame data.
+	void addFrame( uint32_t cameraId, uint64_t sequence, double timestamp, depthrecording::Encoding encoding,
+				   const void *data, size_t dataSize );
+	//! Writes the seek index sorted by timestamp and closes the file.
+	void finish();
+
+	uint64_t getNumFrames() const { return mIndex.size(); }
+	uint64_t getNumBytesWritten() const { return mOffset; }
+
+ protected:
+	DepthRecordingWriter( const ci::fs::path &path, const std::vector< Camera > &cameras );
+
+	void write( const void *data, size_t size );
+	template< typename T >
+	void addChannelFrame( uint32_t cameraId, uint64_t sequence, double timestamp, const ci::ChannelT< T > &channel );
+	template< typename T >
+	void addCompressedChannelFrame( uint32_t cameraId, uint64_t sequence, double timestamp, const ci::ChannelT< T > &channel );
+	template< typename T >
+	const depthrecording::CameraInfo & checkFrame( uint32_t cameraId, const ci::ChannelT< T > &channel ) const;
+
+	FILE *mFile = nullptr;
+	uint64_t mOffset = 0;
+	std::vector< depthrecording::CameraInfo > mCameras;
+	std::vector< depthrecording::IndexEntry > mIndex;
+	std::vector< uint8_t > mRowBuffer;
+	std::vector< uint8_t > mEncodeBuffer;
+};
@@ -0,0 +1,116 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+
+//! Inner loops over the cell grid and the bpm field. The row loops are kept
+//! free of branches and index arithmetic, so the compiler can vectorize them
+//! for any grid size.
+namespace gridkernels
+{
+
+//! Adds the foreground pixels of a row to four interleaved histograms of gridSize^2 + 1 bins
+//! indexed by the cell labels. The labels are read mirrored if \a flip.
+inline void cellHistogramRow( const uint8_t *src, uint8_t increment, const uint16_t *labels, int32_t width, bool flip,
+							  uint8_t threshold, uint32_t inverts, uint32_t *counts, size_t gridSize )
+{
+	const size_t numBins = gridSize * gridSize + 1;
+	if ( flip )
+	{
+		labels += width - 1;
+		for ( int32_t x = 0; x < width; x++ )
+		{
+			const uint32_t foreground = uint32_t( src[ x * increment ] > threshold ) ^ inverts;
+			counts[ ( x & 3 ) * numBins + *( labels - x ) ] += foreground;
+		}
+	}
+	else
+	{
+		for ( int32_t x = 0; x < width; x++ )
+		{
+			const uint32_t foreground = uint32_t( src[ x * increment ] > threshold ) ^ inverts;
+			counts[ ( x & 3 ) * numBins + labels[ x ] ] += foreground;
+		}
+	}
+}
+
+//! Sums the interleaved histograms of cellHistogramRow() and sets the cells covered by at least
+//! \a minCoverage of their pixels to 1, the others to 0.
+inline void cellCoverage( const uint32_t *counts, const uint32_t *cellPixelCounts, float minCoverage,
+						  uint16_t *cellCounts, size_t gridSize )
+{
+	const size_t numCells = gridSize * gridSize;
+	const size_t numBins = numCells + 1;
+	for ( size_t i = 0; i < numCells; i++ )
+	{
+		const uint32_t count = counts[ i ] + counts[ numBins + i ] +
+							   counts[ 2 * numBins + i ] + counts[ 3 * numBins + i ];
+		cellCounts[ i ] = uint16_t( ( count > 0 ) && ( count >= minCoverage * cellPixelCounts[ i ] ) );
+	}
+}
+
+//! Adds the stamps multiplied by \a weight to the row-major sums of the field, see ChannelView.
+//! The stamp pixel ( x, y ) is added to the field at ( x - originX, y - originY ).
+inline void stampAccumulate( const float *rawStamp, const float *bpmStamp, int32_t stampWidth, int32_t stampHeight,
+							 int32_t originX, int32_t originY, float weight, float *rawSum, float *bpmSum,
+							 size_t fieldWidth, size_t fieldHeight )
+{
+	const int32_t w = int32_t( fieldWidth );
+	const int32_t h = int32_t( fieldHeight );
+	const int32_t px = originX;
+	const int32_t py = originY;
+
+	// stamp area covering the field
+	const int32_t x0 = std::max( 0, px );
+	const int32_t x1 = std::min( stampWidth, px + w );
+	const int32_t y0 = std::max( 0, py );
+	const int32_t y1 = std::min( stampHeight, py + h );
+	const int32_t width = x1 - x0;
+
+	for ( int32_t y = y0; y < y1; y++ )
+	{
+		const float *raw = rawStamp + y * stampWidth + x0;
+		const float *bpm = bpmStamp + y * stampWidth + x0;
+		float *rawRow = rawSum + ( y - py ) * w + x0 - px;
+		float *bpmRow = bpmSum + ( y - py ) * w + x0 - px;
+		// both fields in one pass, the sums hold integers so adding and removing a stamp is exact
+		for ( int32_t x = 0; x < width; x++ )
+		{
+			rawRow[ x ] += weight * raw[ x ];
+			bpmRow[ x ] += weight * bpm[ x ];
+		}
+	}
+}
+
+//! Converts the raw and bpm channels of the field to the row-major integer result arrays
+//! and splits the bpm values at even and odd indices.
+inline void fieldResult( const float *base, size_t baseRowStride, const float *bpm, size_t bpmRowStride,
+						 int *raw, int *bpmResult, int *bpmEven, int *bpmOdd, size_t fieldWidth, size_t fieldHeight )
+{
+	const size_t w = fieldWidth;
+	const size_t h = fieldHeight;
+	for ( size_t y = 0; y < h; y++ )
+	{
+		const float *baseRow = base + y * baseRowStride;
+		const float *bpmRow = bpm + y * bpmRowStride;
+		for ( size_t x = 0; x < w; x++ )
+		{
+			raw[ y * w + x ] = int( baseRow[ x ] / 10 );
+			bpmResult[ y * w + x ] = int( bpmRow[ x ] );
+		}
+	}
+
+	const size_t numValues = w * h;
+	for ( size_t i = 0; i < numValues / 2; i++ )
+	{
+		bpmEven[ i ] = bpmResult[ 2 * i ];
+		bpmOdd[ i ] = bpmResult[ 2 * i + 1 ];
+	}
+	if ( numValues % 2 == 1 )
+	{
+		bpmEven[ numValues / 2 ] = bpmResult[ numValues - 1 ];
+	}
+}
+
+} // namespace gridkernels
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "MetronomeSynth.h"
+
+//! Wind-down dynamics of an ensemble of mechanical metronomes. Each metronome is driven by a
+//! spring and its escapement takes a little energy at every beat. As the spring runs down the
+//! metronome slows slightly and ticks softer until it stops. The mechanisms differ a little,
+//! so metronomes set to the same tempo drift apart and stop at different times. The state is
+//! kept in arrays with one entry per metronome and advanced in a single pass per audio block.
+class MetronomeEnsemble
+{
+ public:
+	//! Allocates \a numVoices unwound metronomes, the spread of their mechanisms depends on \a seed.
+	void setup( size_t numVoices, uint32_t seed = 1 );
+	size_t getNumVoices() const { return mNumVoices; }
+
+	//! Seconds a fully wound metronome runs at 120 bpm, 300 by default.
+	void setRunTime( float seconds ) { mRunTime = seconds; }
+	float getRunTime() const { return mRunTime; }
+	//! Relative tempo loss of a metronome just before it stops, 0.03 by default.
+	void setSlowdown( float slowdown ) { mSlowdown = slowdown; }
+	float getSlowdown() const { return mSlowdown; }
+
+	//! Sets the beat frequency of metronome \a i in Hz when fully wound.
+	void setVoice( size_t i, float freq ) { mTargetFreq[ i ] = freq; }
+	float getTargetFrequency( size_t i ) const { return mTargetFreq[ i ]; }
+	//! Winds the springs of all metronomes fully.
+	void wind();
+
+	//! Advances all metronomes by \a seconds.
+	void update( float seconds );
+	//! Bends the voices of \a synth to the current tempo and sets their gain to the swing of the metronomes.
+	void apply( MetronomeSynth *synth ) const;
+
+	float getFrequency( size_t i ) const { return mFreq[ i ]; }
+	//! Energy of the spring of metronome \a i, 1 fully wound and 0 stopped.
+	float getEnergy( size_t i ) const { return mEnergy[ i ]; }
+	size_t getNumRunning() const;
+
+ protected:
+	size_t mNumVoices = 0;
+	float mRunTime = 300.0f;
+	float mSlowdown = 0.03f;
+
+	// mechanism of each metronome
+	std::vector< float > mDetune; // tempo factor around 1
+	std::vector< float > mEscapementLoss; // energy taken per beat relative to the average
+	// metronome state
+	std::vector< float > mTargetFreq;
+	std::vector< float > mEnergy;
+	std::vector< float > mFreq;
+	std::vector< float > mGain;
+};
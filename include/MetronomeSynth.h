@@ -0,0 +1,80 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+#include "ClickEngine.h"
+
+//! Synthesis of all metronome voices, shared by MetronomeSynthNode and the offline
+//! renderer. In FILTERED_PHASORS mode a voice is a phasor at the beat frequency into a
+//! band-pass filter, which rings at the phase reset. The voice state is kept in arrays
+//! and processed in groups of kNumLanes voices, so the block loop vectorizes. In CLICKS
+//! mode the ClickEngine plays the prerendered rings at the ticks. Voice i is mixed to
+//! output channel i % numChannels. Not thread-safe.
+class MetronomeSynth
+{
+ public:
+	enum class Mode : int
+	{
+		FILTERED_PHASORS = 0,
+		CLICKS
+	};
+
+	//! Allocates the voices for \a sampleRate, all silent.
+	void setup( size_t numVoices, float sampleRate, size_t numChannels = 1 );
+
+	size_t getNumVoices() const { return mNumVoices; }
+	size_t getNumChannels() const { return mNumChannels; }
+	float getSampleRate() const { return mSampleRate; }
+
+	void setMode( Mode mode ) { mMode = mode; }
+	Mode getMode() const { return mMode; }
+
+	//! Beat frequency in Hz and filter center frequency in Hz of a metronome at \a bpm.
+	static float getBeatFrequency( float bpm ) { return bpm / 60.0f; }
+	static float getCenterFrequency( float bpm ) { return bpm * 40.0f; }
+
+	//! Sets the beat and the filter center frequencies of voice \a i in Hz.
+	void setVoice( size_t i, float freq, float centerFreq );
+	float getVoiceFrequency( size_t i ) const { return mFreq[ i ]; }
+	float getVoiceCenterFrequency( size_t i ) const { return mCenterFreq[ i ]; }
+	//! Changes the beat frequency of voice \a i keeping its phase, e.g. for a slowly drifting tempo.
+	void bendVoice( size_t i, float freq );
+	//! Sets the gain of voice \a i, 1 by default.
+	void setVoiceGain( size_t i, float gain );
+
+	//! Restarts the phases of all voices, clicks are scheduled from the next sample.
+	void restart();
+
+	//! Renders \a numFrames samples to each of the getNumChannels() \a channels.
+	void process( float *const *channels, size_t numFrames );
+
+	static const size_t kNumLanes = 8;
+
+ protected:
+	void processFilteredPhasors( float *const *channels, size_t numFrames );
+
+	size_t mNumVoices = 0;
+	size_t mNumPaddedVoices = 0; // multiple of kNumLanes, the padding voices are silent
+	size_t mNumChannels = 1;
+	float mSampleRate = 44100.0f;
+	float mQ = 4.0f;
+	float mGain = 0.1f;
+	Mode mMode = Mode::CLICKS;
+
+	// voice parameters
+	std::vector< float > mFreq;
+	std::vector< float > mCenterFreq;
+	std::vector< float > mVoiceGain;
+	// voice state
+	std::vector< float > mPhase;
+	std::vector< float > mPhaseIncrement;
+	std::vector< float > mB0; // band-pass coefficients, b1 = 0 and b2 = -b0
+	std::vector< float > mA1;
+	std::vector< float > mA2;
+	std::vector< float > mZ1; // transposed direct form II filter state
+	std::vector< float > mZ2;
+	std::vector< float > mVoiceOut; // output of the current frame
+
+	ClickEngine mClickEngine;
+};
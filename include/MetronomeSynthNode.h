@@ -0,0 +1,79 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <vector>
+
+#include "cinder/audio/Node.h"
+
+#include "MetronomeEnsemble.h"
+#include "MetronomeSynth.h"
+#include "TripleBuffer.h"
+
+typedef std::shared_ptr< class MetronomeSynthNode > MetronomeSynthNodeRef;
+
+//! Renders every metronome voice of a MetronomeSynth in one mono node.
+class MetronomeSynthNode : public ci::audio::InputNode
+{
+ public:
+	MetronomeSynthNode( size_t numVoices, const Format &format = Format() );
+
+	size_t getNumVoices() const { return mNumVoices; }
+
+	//! Publishes the beat and the filter center frequencies of the voices in Hz to the audio
+	//! thread without locking. Must only be called from one thread at a time, usually the one
+	//! running Sound::update(). The next block picks up the latest frequencies and updates
+	//! the voices that changed.
+	void setVoiceFrequencies( const std::vector< float > &freqs, const std::vector< float > &centerFreqs );
+	//! Returns the version of the last published frequencies and of the ones the audio thread has applied.
+	uint64_t getPublishedVersion() const { return mPublishedVersion; }
+	uint64_t getAppliedVersion() const { return mAppliedVersion; }
+	//! Restarts the phases of all voices in the next block. Clicks are scheduled from its first sample.
+	void resetPhases() { mResetPhases = true; }
+
+	typedef MetronomeSynth::Mode Mode;
+	void setMode( Mode mode ) { mMode = static_cast< int >( mode ); }
+	Mode getMode() const { return static_cast< Mode >( mMode.load() ); }
+
+	//! Runs the voices through the wind-down simulation of a MetronomeEnsemble, otherwise they
+	//! keep the published tempo at full volume.
+	void setWindDownEnabled( bool enabled ) { mWindDownEnabled = enabled; }
+	bool isWindDownEnabled() const { return mWindDownEnabled; }
+	//! Seconds a fully wound metronome runs at 120 bpm.
+	void setRunTime( float seconds ) { mRunTime = seconds; }
+	//! Winds all metronomes fully in the next block.
+	void wind() { mWindRequested = true; }
+	//! Number of metronomes still running in the wind-down simulation.
+	size_t getNumRunning() const { return mNumRunning; }
+
+	//! Time spent in process() relative to the duration of the blocks, smoothed.
+	float getLoad() const { return mLoad; }
+
+ protected:
+	void initialize() override;
+	void process( ci::audio::Buffer *buffer ) override;
+
+	size_t mNumVoices;
+	MetronomeSynth mSynth; // audio thread only
+
+	//! Frequencies of all voices, versioned by the publishing thread.
+	struct VoiceParams
+	{
+		std::vector< float > mFreq;
+		std::vector< float > mCenterFreq;
+		uint64_t mVersion = 0;
+	};
+	mndl::TripleBuffer< VoiceParams > mVoiceParams;
+	std::atomic< uint64_t > mPublishedVersion;
+	std::atomic< uint64_t > mAppliedVersion;
+	std::atomic< bool > mResetPhases;
+	std::atomic< int > mMode;
+
+	MetronomeEnsemble mEnsemble; // audio thread only
+	bool mWindDownActive = false; // audio thread only
+	std::atomic< bool > mWindDownEnabled;
+	std::atomic< bool > mWindRequested;
+	std::atomic< float > mRunTime;
+	std::atomic< size_t > mNumRunning;
+	std::atomic< float > mLoad;
+};
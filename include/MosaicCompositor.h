@@ -0,0 +1,96 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "cinder/Area.h"
+#include "cinder/Channel.h"
+
+typedef std::shared_ptr< class MosaicCompositor > MosaicCompositorRef;
+
+//! Stitches camera channels into a single tracking channel. The stitch plan
+//! is only rebuilt when the layout, the source sizes or the output
+//! resolution change. Each frame only the pixels not covered by any camera
+//! are cleared and the camera tiles are copied row by row on worker threads.
+class MosaicCompositor
+{
+ public:
+	//! \a numThreads is the number of worker threads besides the calling thread, 0 uses all available cores.
+	static MosaicCompositorRef create( size_t numThreads = 0 ) { return MosaicCompositorRef( new MosaicCompositor( numThreads ) ); }
+	~MosaicCompositor();
+
+	struct Tile
+	{
+		ci::Area mSrcArea;
+		ci::ivec2 mOffset;
+	};
+
+	//! Composites \a sources into \a target. Each source is placed according to the same indexed element
+	//! of \a tiles similarly to Channel::copyFrom, empty sources are left out.
+	void update( const std::vector< Tile > &tiles, const std::vector< ci::ChannelRef > &sources, ci::Channel8u *target );
+
+	//! Returns the number of times the stitch plan has been rebuilt.
+	size_t getNumPlanUpdates() const { return mNumPlanUpdates; }
+
+ protected:
+	MosaicCompositor( size_t numThreads );
+
+	struct TilePlan
+	{
+		size_t mSourceId;
+		ci::Area mSrcArea; // clipped to both the source and the target
+		ci::ivec2 mDstPos;
+	};
+
+	//! Horizontal run of uncovered pixels [mX1, mX2) in row mY.
+	struct Span
+	{
+		int32_t mY;
+		int32_t mX1;
+		int32_t mX2;
+	};
+
+	struct Band
+	{
+		int32_t mY1;
+		int32_t mY2;
+		size_t mSpanBegin;
+		size_t mSpanEnd;
+	};
+
+	bool isPlanValid( const std::vector< Tile > &tiles, const std::vector< ci::ChannelRef > &sources,
+					  const ci::Channel8u *target ) const;
+	void calcPlan( const std::vector< Tile > &tiles, const std::vector< ci::ChannelRef > &sources,
+				   const ci::Channel8u *target );
+
+	// plan key
+	std::vector< Tile > mPlanTiles;
+	std::vector< ci::ivec2 > mPlanSourceSizes; // zero size for missing sources
+	ci::ivec2 mPlanTargetSize;
+
+	std::vector< TilePlan > mTilePlans;
+	std::vector< Span > mClearSpans;
+	std::vector< Band > mBands;
+	size_t mNumPlanUpdates = 0;
+
+	void compositeBand( const Band &band );
+	void processBands();
+	void workerThreadFn();
+
+	// frame being composited
+	std::vector< const ci::Channel8u * > mSources;
+	ci::Channel8u *mTarget = nullptr;
+
+	std::vector< std::thread > mWorkers;
+	std::mutex mMutex;
+	std::condition_variable mStartCondition;
+	std::condition_variable mDoneCondition;
+	uint64_t mFrameId = 0;
+	bool mQuit = false;
+	std::atomic< size_t > mNextBand;
+	std::atomic< size_t > mNumBandsDone;
+};
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+#include "cinder/Exception.h"
+#include "cinder/Filesystem.h"
+
+#include "BpmTimeline.h"
+#include "MetronomeEnsemble.h"
+#include "MetronomeSynth.h"
+
+//! Renders a BpmTimeline through MetronomeSynth to a 32-bit float WAV file as fast as
+//! possible, without an audio device. Each field is applied at the sample of its time,
+//! the voices are spread over the channels as in MetronomeSynth.
+class OfflineRenderer
+{
+ public:
+	struct Options
+	{
+		float mSampleRate = 44100.0f;
+		size_t mNumChannels = 2;
+		size_t mBlockSize = 512;
+		MetronomeSynth::Mode mMode = MetronomeSynth::Mode::CLICKS;
+		//! Seconds rendered after the last field.
+		double mTail = 1.0;
+		//! Runs the voices through the wind-down simulation, wound at the start.
+		bool mWindDown = false;
+		float mRunTime = 300.0f;
+	};
+
+	struct Stats
+	{
+		uint64_t mNumFrames = 0;
+		double mRenderedSeconds = 0.0;
+		double mElapsedSeconds = 0.0; // wall clock time of the render and the file writes
+
+		//! Rendered audio seconds per wall clock second.
+		double getRealtimeFactor() const { return ( mElapsedSeconds > 0.0 ) ? mRenderedSeconds / mElapsedSeconds : 0.0; }
+	};
+
+	OfflineRenderer() {}
+	OfflineRenderer( const Options &options ) : mOptions( options ) {}
+
+	//! Renders \a timeline to \a wavPath. Throws ExcOfflineRender if the file cannot be written.
+	//! Nothing is written if \a wavPath is empty, e.g. for measuring the render speed.
+	Stats render( const BpmTimeline &timeline, const ci::fs::path &wavPath );
+
+ protected:
+	Options mOptions;
+	MetronomeSynth mSynth;
+	MetronomeEnsemble mEnsemble;
+};
+
+class ExcOfflineRender : public ci::Exception
+{
+ public:
+	ExcOfflineRender( const std::string &description ) : ci::Exception( description ) {}
+};
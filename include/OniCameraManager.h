@@ -1,14 +1,20 @@
 #pragma once
 
+#include <array>
+#include <atomic>
 #include <memory>
 
 #include "cinder/DataSource.h"
+#include "cinder/ImageIo.h"
 #include "cinder/Surface.h"
 #include "cinder/Thread.h"
 #include "cinder/params/Params.h"
 
 #include "CinderOni.h"
 
+#include "DepthRecorder.h"
+#include "SpscQueue.h"
+
 typedef std::shared_ptr< class OniCameraManager > OniCameraManagerRef;
 
 class OniCameraManager
@@ -19,13 +25,32 @@ class OniCameraManager
 
 	void startup();
 
+	//! Picks up the freshest depth frames. Can be called from a different thread than draw().
 	void update();
 	void draw();
 
+	//! Depth frame stored in the preallocated per-camera ring. The channel is reused when the frame is recycled.
+	struct DepthFrame
+	{
+		ci::ChannelRef mChannel;
+		uint64_t mSequence = 0;
+		double mTimestamp = 0.0;
+		//! The channel holds the binary foreground mask of the depth band instead of the inverted depth.
+		bool mDepthBand = false;
+	};
+
 	size_t getNumCameras();
+	//! Returns the latest depth channel of camera \a i. Points into the frame ring, no copy is made.
 	ci::ChannelRef getCameraChannel( size_t i );
+	//! Returns the latest depth frame of camera \a i with its sequence number and capture timestamp.
+	const DepthFrame & getCameraFrame( size_t i );
 	std::string getCameraLabel( size_t i );
 
+	//! Starts recording the opened cameras to \a path from their capture threads. Refuses to record
+	//! if a camera was opened with depth band segmentation, as its frames only hold the band mask.
+	void startRecording( const ci::fs::path &path );
+	void stopRecording();
+
  protected:
 	OniCameraManager();
 
@@ -46,6 +71,42 @@ class OniCameraManager
 	std::vector< ci::ivec2 > mCameraResolutions =
 		{ ci::ivec2( 320, 240 ), ci::ivec2( 640, 480 ) };
 
+	//! Segments the 16-bit depth with the per-camera near/far band instead of converting it to 8 bits. Applied when a camera is opened.
+	bool mDepthBandEnabled = false;
+
+	static const int kDefaultDepthNear = 500;
+	static const int kDefaultDepthFar = 4000;
+
+	//! Depth frame ring shared by the capture thread and the consumer thread. The
+	//! capture thread takes slots from \a mFreeFrames, fills them and publishes
+	//! them in \a mReadyFrames. The consumer thread keeps the freshest one and
+	//! returns the rest to \a mFreeFrames.
+	struct DepthFrameQueue
+	{
+		DepthFrameQueue();
+
+		static const size_t kNumDepthFrames = 4;
+		std::array< DepthFrame, kNumDepthFrames > mFrames;
+		mndl::SpscQueue< size_t > mFreeFrames;
+		mndl::SpscQueue< size_t > mReadyFrames;
+		uint64_t mSequence = 0;
+		std::atomic< bool > mCaptureRunning;
+		//! Frames the capture thread found no free slot for.
+		std::atomic< uint64_t > mNumDroppedFrames;
+		ci::ChannelRef mRecordChannel; // holds the frames to record while the ring is full, used by the capture thread only
+
+		//! Depth band segmentation, frames contain the foreground mask of the band instead of the inverted depth.
+		bool mDepthBandEnabled = false;
+		std::atomic< uint16_t > mDepthNear;
+		std::atomic< uint16_t > mDepthFar;
+		ci::Channel16uRef mRawDepth; // used by the capture thread only
+
+		//! Recorder of the frames, accessed with std::atomic_load/store.
+		DepthRecorderRef mRecorder;
+		size_t mRecorderCameraId = 0;
+	};
+	typedef std::shared_ptr< DepthFrameQueue > DepthFrameQueueRef;
+
 	struct OniCamera
 	{
 		std::string mName;
@@ -54,12 +115,25 @@ class OniCameraManager
 		std::string mLabel; // unique label created from name and serial
 
 		std::string mProgressMessage;
+		int mDepthNear = kDefaultDepthNear; // depth band in millimetres
+		int mDepthFar = kDefaultDepthFar;
 		mndl::oni::OniCaptureRef mCapture;
 		std::shared_ptr< std::thread > mOpenThread;
+		std::shared_ptr< std::thread > mCaptureThread;
 
-		ci::ChannelRef mDepthChannel;
+		DepthFrameQueueRef mDepthFrameQueue;
+		size_t mDepthFrameId = 0; // index of the frame held by the consumer thread
+
+		ci::ChannelRef mDebugChannel; // copy of the latest frame for the debug view
 	};
 
+	//! Pulls depth frames from \a capture and publishes them in \a queue until capture is stopped.
+	void captureThreadFn( mndl::oni::OniCaptureRef capture, DepthFrameQueueRef queue );
+	void stopCaptureThread( OniCamera &cam );
+	//! Stores \a image in a free slot of \a queue and hands it to the recorder. Returns false if the
+	//! ring was full, the frame is still recorded then.
+	bool storeDepthFrame( DepthFrameQueue *queue, const ci::ImageSourceRef &image );
+
 	std::vector< OniCamera > mOniCameras;
 
 	void setupOpenCamera( size_t cameraId );
@@ -73,9 +147,18 @@ class OniCameraManager
 	void writeCameraConfig( const ci::DataTargetRef &target );
 
 	std::mutex mOniCameraOpenMutex;
+	//! Guards mOniCameras against reallocation and the debug channels between update() and draw().
+	std::mutex mOniCamerasMutex;
 
 	bool mDebugDraw = false;
 
+	int mRingDroppedFrames = 0; // of all cameras since they were opened
+	DepthRecorderRef mRecorder; // guarded by mOniCamerasMutex
+	int mRecordedFrames = 0;
+	int mDroppedFrames = 0;
+	float mRecordingThroughput = 0.0f; // MB/s
+	float mRecordingCompressionRatio = 0.0f;
+
 	std::string mLastCameraConfig;
 	bool mLoadCameraConfigAtStart = false;
 };
@@ -4,4 +4,6 @@
 #define BASE_IMAGE	CINDER_RESOURCE( ../resources/, baseImage10x10.png, 128, IMAGE )
 #define C_IMAGE	CINDER_RESOURCE( ../resources/, patternImage.png, 128, IMAGE )
 #define CA_IMAGE	CINDER_RESOURCE( ../resources/, patternImageAlpha.png, 128, IMAGE )
+#define CUSTOM_IMAGE	CINDER_RESOURCE( ../resources/, customImage.png, 128, IMAGE )
+#define CUSTOM_PATTERN_IMAGE	CINDER_RESOURCE( ../resources/, customPattern.png, 128, IMAGE )
 
@@ -2,21 +2,24 @@
 
 #include "cinder/CinderResources.h"
 #include "cinder/audio/Context.h"
-#include "cinder/audio/GenNode.h"
-#include "cinder/audio/GainNode.h"
-#include "cinder/audio/FilterNode.h"
+
+#include "MetronomeSynthNode.h"
 
 class Sound {
 public:
     
     Sound();
     
-    void setup( ci::audio::Context &ctx );
-    void update( std::vector< int > bpmVals );
+    //! Sets up \a numVoices metronome voices, one per grid cell if 0.
+    void setup( ci::audio::Context &ctx, int numVoices = 0 );
+    void update( const std::vector< int > &bpmVals );
     void draw();
     void sync();
     
-    std::vector< ci::audio::GenNodeRef >    mPhasorGens;
-    std::vector< ci::audio::FilterBandPassNodeRef > mFilters;
-    std::vector< ci::audio::GainNodeRef >	mGains;
+    //! Renders all metronomes of the grid.
+    MetronomeSynthNodeRef mSynth;
+
+protected:
+    std::vector< float > mFreqs;
+    std::vector< float > mCenterFreqs;
 };
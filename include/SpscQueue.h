@@ -0,0 +1,56 @@
+#pragma once
+
+#include <atomic>
+#include <vector>
+
+namespace mndl
+{
+
+//! Bounded lock-free queue for exactly one producer and one consumer thread.
+template< typename T >
+class SpscQueue
+{
+ public:
+	explicit SpscQueue( size_t capacity ) : mBuffer( capacity + 1 ), mHead( 0 ), mTail( 0 ) {}
+
+	SpscQueue( const SpscQueue & ) = delete;
+	SpscQueue & operator=( const SpscQueue & ) = delete;
+
+	//! Called from the producer thread. Returns false if the queue is full.
+	bool push( const T &value )
+	{
+		size_t tail = mTail.load( std::memory_order_relaxed );
+		size_t next = increment( tail );
+		if ( next == mHead.load( std::memory_order_acquire ) )
+		{
+			return false;
+		}
+		mBuffer[ tail ] = value;
+		mTail.store( next, std::memory_order_release );
+		return true;
+	}
+
+	//! Called from the consumer thread. Returns false if the queue is empty.
+	bool pop( T *value )
+	{
+		size_t head = mHead.load( std::memory_order_relaxed );
+		if ( head == mTail.load( std::memory_order_acquire ) )
+		{
+			return false;
+		}
+		*value = mBuffer[ head ];
+		mHead.store( increment( head ), std::memory_order_release );
+		return true;
+	}
+
+	size_t getCapacity() const { return mBuffer.size() - 1; }
+
+ protected:
+	size_t increment( size_t i ) const { return ( i + 1 ) % mBuffer.size(); }
+
+	std::vector< T > mBuffer;
+	std::atomic< size_t > mHead;
+	std::atomic< size_t > mTail;
+};
+
+} // namespace mndl
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+namespace mndl
+{
+
+//! Lock-free handoff of the latest value from exactly one producer to exactly one consumer
+//! thread. The producer writes the back buffer and publishes it, the consumer picks up the
+//! most recently published one. Neither side ever waits, values published in between are skipped.
+template< typename T >
+class TripleBuffer
+{
+ public:
+	TripleBuffer() : mBack( 0 ), mMiddle( 1 ), mFront( 2 ) {}
+
+	TripleBuffer( const TripleBuffer & ) = delete;
+	TripleBuffer & operator=( const TripleBuffer & ) = delete;
+
+	//! Called from the producer thread. The buffer is not cleared, it holds an older value.
+	T & getBack() { return mBuffers[ mBack ]; }
+	//! Called from the producer thread, makes the back buffer the latest value.
+	void publish()
+	{
+		uint8_t middle = mMiddle.exchange( uint8_t( mBack | kDirty ), std::memory_order_acq_rel );
+		mBack = middle & kIndexMask;
+	}
+
+	//! Called from the consumer thread. Returns true if a value has been published since the last call.
+	bool update()
+	{
+		if ( ! ( mMiddle.load( std::memory_order_relaxed ) & kDirty ) )
+		{
+			return false;
+		}
+		uint8_t middle = mMiddle.exchange( mFront, std::memory_order_acq_rel );
+		mFront = middle & kIndexMask;
+		return true;
+	}
+	//! Called from the consumer thread, returns the value picked up by the last update().
+	const T & getFront() const { return mBuffers[ mFront ]; }
+
+	//! Gives access to all buffers for preallocation before the buffer is shared between threads.
+	T & getBuffer( size_t i ) { return mBuffers[ i ]; }
+	static const size_t kNumBuffers = 3;
+
+ protected:
+	static const uint8_t kIndexMask = 3;
+	static const uint8_t kDirty = 4;
+
+	T mBuffers[ kNumBuffers ];
+	uint8_t mBack; // producer thread only
+	std::atomic< uint8_t > mMiddle; // index and dirty flag
+	uint8_t mFront; // consumer thread only
+};
+
+} // namespace mndl
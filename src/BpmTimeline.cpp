@@ -0,0 +1,116 @@
+#include <algorithm>
+#include <fstream>
+#include <random>
+#include <sstream>
+
+#include "BpmTimeline.h"
+
+using namespace ci;
+
+void BpmTimeline::addField( double time, const std::vector< int > &bpm )
+{
+	// out of order times are moved to the time of the last field, the times never decrease
+	mFields.push_back( { std::max( time, getDuration() ), bpm } );
+}
+
+size_t BpmTimeline::getNumVoices() const
+{
+	size_t numVoices = 0;
+	for ( const auto &field : mFields )
+	{
+		numVoices = std::max( numVoices, field.mBpm.size() );
+	}
+	return numVoices;
+}
+
+// static
+BpmTimeline BpmTimeline::read( const fs::path &path )
+{
+	std::ifstream file( path.string() );
+	if ( ! file )
+	{
+		throw ExcBpmTimeline( "Could not open " + path.string() );
+	}
+
+	BpmTimeline timeline;
+	std::string line;
+	size_t lineNumber = 0;
+	while ( std::getline( file, line ) )
+	{
+		lineNumber++;
+		if ( line.empty() || ( line[ 0 ] == '#' ) )
+		{
+			continue;
+		}
+
+		std::istringstream values( line );
+		double time;
+		if ( ! ( values >> time ) )
+		{
+			throw ExcBpmTimeline( path.string() + ":" + std::to_string( lineNumber ) + ": missing time" );
+		}
+		std::vector< int > bpm;
+		int value;
+		while ( values >> value )
+		{
+			bpm.push_back( value );
+		}
+		if ( ! values.eof() )
+		{
+			throw ExcBpmTimeline( path.string() + ":" + std::to_string( lineNumber ) + ": invalid bpm value" );
+		}
+		timeline.addField( time, bpm );
+	}
+	return timeline;
+}
+
+void BpmTimeline::write( const fs::path &path ) const
+{
+	std::ofstream file( path.string() );
+	if ( ! file )
+	{
+		throw ExcBpmTimeline( "Could not create " + path.string() );
+	}
+
+	file << "# time bpm0 bpm1 ...\n";
+	for ( const auto &field : mFields )
+	{
+		file << field.mTime;
+		for ( int bpm : field.mBpm )
+		{
+			file << " " << bpm;
+		}
+		file << "\n";
+	}
+
+	if ( ! file )
+	{
+		throw ExcBpmTimeline( "Could not write " + path.string() );
+	}
+}
+
+// static
+BpmTimeline BpmTimeline::generate( size_t numVoices, double duration, double fieldRate, uint32_t seed )
+{
+	std::mt19937 rng( seed );
+	std::uniform_int_distribution< int > startBpm( 40, 220 );
+	std::uniform_int_distribution< int > step( -3, 3 );
+
+	std::vector< int > bpm( numVoices );
+	for ( auto &b : bpm )
+	{
+		b = startBpm( rng );
+	}
+
+	BpmTimeline timeline;
+	const size_t numFields = size_t( duration * fieldRate ) + 1;
+	for ( size_t i = 0; i < numFields; i++ )
+	{
+		timeline.addField( i / fieldRate, bpm );
+		for ( auto &b : bpm )
+		{
+			b = std::min( std::max( b + step( rng ), 40 ), 220 );
+		}
+	}
+	return timeline;
+}
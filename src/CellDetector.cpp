@@ -1,9 +1,12 @@
+#include <cmath>
 #include <string>
 
+#include "cinder/app/App.h"
 #include "cinder/gl/gl.h"
 
 #include "CellDetector.h"
 #include "GlobalData.h"
+#include "GridKernels.h"
 
 using namespace ci;
 
@@ -19,101 +22,437 @@ void CellDetector::setupParams()
 	mParams = params::InterfaceGl::create( "Cell detector", ivec2( 300, 300 ) );
 	mParams->setPosition( ivec2( 548, 16 ) );
 
+	// the params and the config edit a copy on the ui thread, see commitParams()
+	Settings &settings = mParamSettings;
 	mParams->addText( "Grid" );
 	const std::string gridAreaGroup = "grid area";
-	mParams->addParam( "Grid area X1", &mNormalizedGridArea.x1 ).min( 0.0f ).
+	mParams->addParam( "Grid area X1", &settings.mNormalizedGridArea.x1 ).min( 0.0f ).
 		max( 1.0f ).step( 0.005f ).group( gridAreaGroup );
-	mParams->addParam( "Grid area Y1", &mNormalizedGridArea.y1 ).min( 0.0f).
+	mParams->addParam( "Grid area Y1", &settings.mNormalizedGridArea.y1 ).min( 0.0f).
 		max( 1.0f ).step( 0.005f ).group( gridAreaGroup );
-	mParams->addParam( "Grid area X2", &mNormalizedGridArea.x2 ).min( 0.0f).
+	mParams->addParam( "Grid area X2", &settings.mNormalizedGridArea.x2 ).min( 0.0f).
 		max( 1.0f ).step( 0.005f ).group( gridAreaGroup );
-	mParams->addParam( "Grid area Y2", &mNormalizedGridArea.y2 ).min( 0.0f).
+	mParams->addParam( "Grid area Y2", &settings.mNormalizedGridArea.y2 ).min( 0.0f).
 		max( 1.0f ).step( 0.005f ).group( gridAreaGroup );
 
-	gd.mConfig->addVar( "CellDetector.Grid.Area.x1", &mNormalizedGridArea.x1, 0.0f );
-	gd.mConfig->addVar( "CellDetector.Grid.Area.y1", &mNormalizedGridArea.y1, 0.0f );
-	gd.mConfig->addVar( "CellDetector.Grid.Area.x2", &mNormalizedGridArea.x2, 1.0f );
-	gd.mConfig->addVar( "CellDetector.Grid.Area.y2", &mNormalizedGridArea.y2, 1.0f );
+	gd.mConfig->addVar( "CellDetector.Grid.Area.x1", &settings.mNormalizedGridArea.x1, 0.0f );
+	gd.mConfig->addVar( "CellDetector.Grid.Area.y1", &settings.mNormalizedGridArea.y1, 0.0f );
+	gd.mConfig->addVar( "CellDetector.Grid.Area.x2", &settings.mNormalizedGridArea.x2, 1.0f );
+	gd.mConfig->addVar( "CellDetector.Grid.Area.y2", &settings.mNormalizedGridArea.y2, 1.0f );
+
+	mParams->addParam( "Perspective grid", &settings.mPerspectiveEnabled );
+	const std::string gridCornersGroup = "grid corners";
+	const std::array< std::string, 4 > cornerNames = { { "top left", "top right", "bottom right", "bottom left" } };
+	const std::array< vec2, 4 > defaultCorners = { { vec2( 0.0f, 0.0f ), vec2( 1.0f, 0.0f ), vec2( 1.0f, 1.0f ), vec2( 0.0f, 1.0f ) } };
+	for ( size_t i = 0; i < settings.mNormalizedGridCorners.size(); i++ )
+	{
+		mParams->addParam( "Corner " + cornerNames[ i ] + " X", &settings.mNormalizedGridCorners[ i ].x ).min( 0.0f ).
+			max( 1.0f ).step( 0.005f ).group( gridCornersGroup );
+		mParams->addParam( "Corner " + cornerNames[ i ] + " Y", &settings.mNormalizedGridCorners[ i ].y ).min( 0.0f ).
+			max( 1.0f ).step( 0.005f ).group( gridCornersGroup );
+
+		const std::string configName = "CellDetector.Grid.Corner" + std::to_string( i );
+		gd.mConfig->addVar( configName + ".x", &settings.mNormalizedGridCorners[ i ].x, defaultCorners[ i ].x );
+		gd.mConfig->addVar( configName + ".y", &settings.mNormalizedGridCorners[ i ].y, defaultCorners[ i ].y );
+	}
+	mParams->setOptions( gridCornersGroup, "opened=false" );
+	gd.mConfig->addVar( "CellDetector.Grid.Perspective", &settings.mPerspectiveEnabled, false );
+
+	mParams->addSeparator();
+	mParams->addText( "Detection" );
+	mParams->addParam( "Detection mode", { "blob centers", "pixel coverage" },
+					   reinterpret_cast< int * >( &settings.mDetectionMode ) );
+	mParams->addParam( "Min cell coverage", &settings.mMinCoverage ).min( 0.0f ).max( 1.0f ).step( 0.01f );
+	mParams->addParam( "Hysteresis unit", { "frames", "milliseconds" },
+					   reinterpret_cast< int * >( &settings.mHysteresisUnit ) );
+	mParams->addParam( "Enter delay", &settings.mEnterDelay ).min( 0 ).max( 10000 );
+	mParams->addParam( "Exit delay", &settings.mExitDelay ).min( 0 ).max( 10000 );
+	gd.mConfig->addVar( "CellDetector.DetectionMode", reinterpret_cast< int * >( &settings.mDetectionMode ), 0 );
+	gd.mConfig->addVar( "CellDetector.MinCoverage", &settings.mMinCoverage, 0.25f );
+	gd.mConfig->addVar( "CellDetector.HysteresisUnit", reinterpret_cast< int * >( &settings.mHysteresisUnit ), 0 );
+	gd.mConfig->addVar( "CellDetector.EnterDelay", &settings.mEnterDelay, 0 );
+	gd.mConfig->addVar( "CellDetector.ExitDelay", &settings.mExitDelay, 0 );
+	commitParams();
+}
+
+void CellDetector::commitParams()
+{
+	std::lock_guard< std::mutex > lock( mSettingsMutex );
+	mPendingSettings = mParamSettings;
+}
+
+void CellDetector::applyParams()
+{
+	std::lock_guard< std::mutex > lock( mSettingsMutex );
+	mNormalizedGridArea = mPendingSettings.mNormalizedGridArea;
+	mPerspectiveEnabled = mPendingSettings.mPerspectiveEnabled;
+	mNormalizedGridCorners = mPendingSettings.mNormalizedGridCorners;
+	mDetectionMode = mPendingSettings.mDetectionMode;
+	mMinCoverage = mPendingSettings.mMinCoverage;
+	mHysteresisUnit = mPendingSettings.mHysteresisUnit;
+	mEnterDelay = mPendingSettings.mEnterDelay;
+	mExitDelay = mPendingSettings.mExitDelay;
 }
 
 void CellDetector::resize( const Rectf &bounds )
 {
+	mScreenBounds = bounds;
 	mNormalizedToScreenMapping = RectMapping( Rectf( vec2( 0.0f ), vec2( 1.0f ) ), bounds );
 }
 
-void CellDetector::update( const std::vector< mndl::blobtracker::BlobRef > &blobs )
+std::array< vec2, 4 > CellDetector::getGridCorners() const
+{
+	if ( mPerspectiveEnabled )
+	{
+		return mNormalizedGridCorners;
+	}
+
+	const Rectf &area = mNormalizedGridArea;
+	return { { vec2( area.x1, area.y1 ), vec2( area.x2, area.y1 ), vec2( area.x2, area.y2 ), vec2( area.x1, area.y2 ) } };
+}
+
+Rectf CellDetector::getNormalizedGridBounds() const
+{
+	const auto corners = getGridCorners();
+	return Rectf( std::vector< vec2 >( corners.begin(), corners.end() ) );
+}
+
+bool CellDetector::updateGrid()
 {
 	const GlobalData &gd = GlobalData::get();
 
-	if ( mLastGridSize != gd.mGridSize )
+	bool changed = false;
+	if ( ( mLastGridSize != gd.mGridSize ) ||
+		 ( mLastGridCorners != getGridCorners() ) ||
+		 ( mLastFrameSize != mFrameSize ) )
 	{
 		calcGridCells();
+		changed = true;
+	}
+
+	// switching the detection recomputes the cells even if the input has not changed
+	if ( ( mLastDetectionMode != mDetectionMode ) || ( mLastMinCoverage != mMinCoverage ) )
+	{
+		mLastDetectionMode = mDetectionMode;
+		mLastMinCoverage = mMinCoverage;
+		changed = true;
+	}
+	return changed;
+}
+
+void CellDetector::finishUpdate( bool gridChanged, bool newInput )
+{
+	const size_t numCells = mLastGridSize * mLastGridSize;
+	if ( gridChanged && ( mCellStates.size() != numCells ) )
+	{
+		// cells of a different grid have nothing in common, the hysteresis starts over
+		mCellStates.assign( numCells, CellState() );
+	}
+
+	const double now = app::getElapsedSeconds();
+	bool cellsChanged = false;
+	mNumPendingCells = 0;
+
+	for ( size_t i = 0; i < numCells; i++ )
+	{
+		CellState &cell = mCellStates[ i ];
+		const uint16_t rawCount = mRawCellCounts[ i ];
+		if ( rawCount == cell.mCount )
+		{
+			cell.mPendingFrames = 0;
+			cell.mPendingSince = -1.0;
+			continue;
+		}
+
+		// a change has to persist for the enter or exit delay before it is accepted
+		if ( newInput )
+		{
+			cell.mPendingFrames++;
+		}
+		if ( cell.mPendingSince < 0.0 )
+		{
+			cell.mPendingSince = now;
+		}
+		const int delay = ( rawCount > cell.mCount ) ? mEnterDelay : mExitDelay;
+		const bool accepted = ( mHysteresisUnit == HysteresisUnit::FRAMES ) ?
+							  ( cell.mPendingFrames >= delay ) :
+							  ( ( now - cell.mPendingSince ) * 1000.0 >= delay );
+		if ( ! accepted )
+		{
+			mNumPendingCells++;
+			continue;
+		}
+
+		cell.mCount = rawCount;
+		cell.mPendingFrames = 0;
+		cell.mPendingSince = -1.0;
+		cellsChanged = true;
 	}
 
-	mBlobCellCoords.clear();
-	for ( const auto &blob : blobs )
+	if ( cellsChanged || gridChanged )
 	{
-		const size_t gridSize = gd.mGridSize;
-		for ( size_t y = 0; y < gridSize; y++ )
+		// a cell holding more blobs is listed once for each
+		mBlobCellCoords.clear();
+		mOccupancy.reset();
+		for ( size_t i = 0; i < numCells; i++ )
 		{
-			for ( size_t x = 0; x < gridSize; x++ )
+			if ( ( mCellStates[ i ].mCount > 0 ) && ( i < mOccupancy.size() ) )
 			{
-				if ( mGridCells[ y ][ x ].contains( blob->mPos ) )
-				{
-					mBlobCellCoords.push_back( ivec2( x, y ) );
-				}
+				mOccupancy.set( i );
+			}
+			for ( uint16_t c = 0; c < mCellStates[ i ].mCount; c++ )
+			{
+				mBlobCellCoords.push_back( ivec2( i % mLastGridSize, i / mLastGridSize ) );
 			}
 		}
 	}
+
+	if ( cellsChanged )
+	{
+		mGeneration++;
+		publishDrawState();
+	}
+	else
+	if ( gridChanged )
+	{
+		publishDrawState();
+	}
 }
 
-void CellDetector::draw()
+void CellDetector::update( const std::vector< mndl::blobtracker::BlobRef > &blobs, uint64_t blobsGeneration,
+						   const Rectf &normalizedBlobArea )
 {
-	gl::ScopedAlphaBlend blending( false );
+	const bool gridChanged = updateGrid();
+	const bool newInput = gridChanged || ( blobsGeneration != mLastInputGeneration );
+	if ( ! newInput && ( mNumPendingCells == 0 ) )
+	{
+		return;
+	}
 
-	for ( const auto &gridRow : mGridCells )
+	if ( newInput )
 	{
-		for ( const auto &cellRect : gridRow )
+		mLastInputGeneration = blobsGeneration;
+		mRawCellCounts.assign( mLastGridSize * mLastGridSize, 0 );
+		for ( const auto &blob : blobs )
 		{
-			Rectf mappedRect = mNormalizedToScreenMapping.map( cellRect );
-			gl::drawStrokedRect( mappedRect );
+			// from the tracked area to the full frame
+			const vec2 blobPos = normalizedBlobArea.getUpperLeft() + blob->mPos * normalizedBlobArea.getSize();
+			int cellIndex = getCellIndex( blobPos );
+			if ( cellIndex >= 0 )
+			{
+				mRawCellCounts[ cellIndex ]++;
+			}
 		}
 	}
 
-	gl::ScopedColor color( ColorA( 1.0f, 0.0f, 0.0f, 0.4f ) );
-	for ( const auto &coord : mBlobCellCoords )
+	finishUpdate( gridChanged, newInput );
+}
+
+void CellDetector::update( const Channel8u &channel, uint8_t threshold, bool thresholdInverts, bool flip,
+						   uint64_t channelGeneration )
+{
+	const bool gridChanged = updateGrid();
+	const bool newInput = gridChanged || ( channelGeneration != mLastInputGeneration );
+	if ( ! newInput && ( mNumPendingCells == 0 ) )
+	{
+		return;
+	}
+
+	const size_t numCells = mLastGridSize * mLastGridSize;
+	const int32_t width = mLastFrameSize.x;
+	const int32_t height = mLastFrameSize.y;
+	if ( newInput )
+	{
+		mLastInputGeneration = channelGeneration;
+		mRawCellCounts.assign( numCells, 0 );
+	}
+	if ( ! newInput || ( channel.getWidth() != width ) || ( channel.getHeight() != height ) || mCellLabels.empty() )
 	{
-		Rectf cellRect = mGridCells[ coord.y ][ coord.x ];
-		cellRect.inflate( vec2( -0.02f ) );
-		Rectf mappedRect = mNormalizedToScreenMapping.map( cellRect );
-		gl::drawSolidRect( mappedRect );
+		finishUpdate( gridChanged, newInput );
+		return;
 	}
+
+	// foreground pixels are counted per cell in a single pass over the label map, pixels
+	// outside of the grid go to the last bin. Four interleaved histograms avoid stalls
+	// on consecutive increments of the same bin.
+	const size_t numBins = numCells + 1;
+	mCellCounts.assign( numBins * 4, 0 );
+	const uint32_t inverts = thresholdInverts ? 1 : 0;
+	const uint8_t increment = channel.getIncrement();
+	for ( int32_t y = 0; y < height; y++ )
+	{
+		gridkernels::cellHistogramRow( channel.getData( ivec2( 0, y ) ), increment, &mCellLabels[ size_t( y ) * width ],
+									   width, flip, threshold, inverts, mCellCounts.data(), mLastGridSize );
+	}
+	gridkernels::cellCoverage( mCellCounts.data(), mCellPixelCounts.data(), mMinCoverage, mRawCellCounts.data(),
+							   mLastGridSize );
+
+	finishUpdate( gridChanged, newInput );
 }
 
-void CellDetector::calcGridCells()
+void CellDetector::publishDrawState()
 {
-	mGridCells.clear();
+	auto drawState = std::make_shared< DrawState >();
+	drawState->mGridSize = mLastGridSize;
+	drawState->mGridPoints = mGridPoints;
+	drawState->mBlobCellCoords = mBlobCellCoords;
+	std::atomic_store( &mDrawState, DrawStateRef( drawState ) );
+}
+
+void CellDetector::draw()
+{
+	DrawStateRef drawState = std::atomic_load( &mDrawState );
+	if ( ! drawState )
+	{
+		return;
+	}
+
+	// the perspective grid is only tessellated when it changes
+	if ( drawState != mBatchState )
+	{
+		const size_t gridSize = drawState->mGridSize;
+		const size_t numPoints = gridSize + 1;
+		const auto &points = drawState->mGridPoints;
+
+		mGridBatch = gl::VertBatch::create( GL_LINES );
+		for ( size_t i = 0; i < numPoints; i++ )
+		{
+			for ( size_t j = 0; j < gridSize; j++ )
+			{
+				mGridBatch->vertex( points[ i * numPoints + j ] );
+				mGridBatch->vertex( points[ i * numPoints + j + 1 ] );
+				mGridBatch->vertex( points[ j * numPoints + i ] );
+				mGridBatch->vertex( points[ ( j + 1 ) * numPoints + i ] );
+			}
+		}
+
+		mCellsBatch = gl::VertBatch::create( GL_TRIANGLES );
+		for ( const auto &coord : drawState->mBlobCellCoords )
+		{
+			vec2 corners[ 4 ] = { points[ coord.y * numPoints + coord.x ],
+								  points[ coord.y * numPoints + coord.x + 1 ],
+								  points[ ( coord.y + 1 ) * numPoints + coord.x + 1 ],
+								  points[ ( coord.y + 1 ) * numPoints + coord.x ] };
+			const vec2 center = ( corners[ 0 ] + corners[ 1 ] + corners[ 2 ] + corners[ 3 ] ) * 0.25f;
+			for ( auto &corner : corners )
+			{
+				corner = glm::mix( corner, center, 0.2f );
+			}
+			const int triangles[ 6 ] = { 0, 1, 2, 0, 2, 3 };
+			for ( int c : triangles )
+			{
+				mCellsBatch->vertex( corners[ c ] );
+			}
+		}
+
+		mBatchState = drawState;
+	}
+
+	gl::ScopedAlphaBlend blending( false );
+	gl::ScopedGlslProg shader( gl::getStockShader( gl::ShaderDef().color() ) );
+	gl::ScopedModelMatrix modelMatrix;
+	gl::translate( mScreenBounds.getUpperLeft() );
+	gl::scale( mScreenBounds.getSize() );
+
+	mGridBatch->draw();
 
+	gl::ScopedColor color( ColorA( 1.0f, 0.0f, 0.0f, 0.4f ) );
+	mCellsBatch->draw();
+}
+
+void CellDetector::calcGridCells()
+{
 	const GlobalData &gd = GlobalData::get();
 	const size_t gridSize = gd.mGridSize;
+	mLastGridSize = gridSize;
+	mLastGridCorners = getGridCorners();
+	mLastFrameSize = mFrameSize;
+
+	// homography from the unit square to the corners ( Heckbert, Fundamentals of Texture Mapping )
+	const auto &p = mLastGridCorners;
+	const vec2 d1 = p[ 1 ] - p[ 2 ];
+	const vec2 d2 = p[ 3 ] - p[ 2 ];
+	const vec2 d3 = p[ 0 ] - p[ 1 ] + p[ 2 ] - p[ 3 ];
+	float g = 0.0f;
+	float h = 0.0f;
+	const float den = d1.x * d2.y - d2.x * d1.y;
+	if ( ( d3 != vec2( 0.0f ) ) && ( den != 0.0f ) )
+	{
+		g = ( d3.x * d2.y - d2.x * d3.y ) / den;
+		h = ( d1.x * d3.y - d3.x * d1.y ) / den;
+	}
+	mGridToFrame = mat3( vec3( p[ 1 ] - p[ 0 ] + g * p[ 1 ], g ),
+						 vec3( p[ 3 ] - p[ 0 ] + h * p[ 3 ], h ),
+						 vec3( p[ 0 ], 1.0f ) );
+
+	const size_t numPoints = gridSize + 1;
+	mGridPoints.resize( numPoints * numPoints );
+	for ( size_t y = 0; y < numPoints; y++ )
+	{
+		for ( size_t x = 0; x < numPoints; x++ )
+		{
+			vec3 pos = mGridToFrame * vec3( vec2( x, y ) / float( gridSize ), 1.0f );
+			mGridPoints[ y * numPoints + x ] = vec2( pos ) / pos.z;
+		}
+	}
 
-	vec2 step = vec2( mNormalizedGridArea.getWidth() / gridSize,
-					  mNormalizedGridArea.getHeight() / gridSize );
-	vec2 pos = mNormalizedGridArea.getUpperLeft();
+	// bake the cell index of every pixel center
+	const int32_t width = mFrameSize.x;
+	const int32_t height = mFrameSize.y;
+	const uint16_t outside = static_cast< uint16_t >( gridSize * gridSize );
+	mCellLabels.assign( size_t( width ) * height, outside );
+	mCellPixelCounts.assign( gridSize * gridSize, 0 );
+	if ( ( gridSize == 0 ) || ( std::abs( glm::determinant( mGridToFrame ) ) < 1e-12f ) )
+	{
+		return;
+	}
 
-	for ( int y = 0; y < gd.mGridSize; y++, pos.y += step.y )
+	const mat3 frameToGrid = glm::inverse( mGridToFrame );
+	const vec3 stepX = frameToGrid[ 0 ] / float( width );
+	for ( int32_t y = 0; y < height; y++ )
 	{
-		std::vector< Rectf > gridRow;
-		pos.x = mNormalizedGridArea.getX1();
-		for ( int x = 0; x < gd.mGridSize; x++, pos.x += step.x )
+		vec3 uvw = frameToGrid * vec3( 0.5f / width, ( y + 0.5f ) / height, 1.0f );
+		uint16_t *labels = &mCellLabels[ size_t( y ) * width ];
+		for ( int32_t x = 0; x < width; x++, uvw += stepX )
 		{
-			gridRow.emplace_back( Rectf( pos, pos + step ) );
+			if ( uvw.z <= 0.0f )
+			{
+				continue;
+			}
+			const vec2 cell = glm::floor( vec2( uvw ) / uvw.z * float( gridSize ) );
+			if ( ( cell.x >= 0.0f ) && ( cell.y >= 0.0f ) && ( cell.x < gridSize ) && ( cell.y < gridSize ) )
+			{
+				const size_t cellIndex = size_t( cell.y ) * gridSize + size_t( cell.x );
+				labels[ x ] = static_cast< uint16_t >( cellIndex );
+				mCellPixelCounts[ cellIndex ]++;
+			}
 		}
-		mGridCells.emplace_back( gridRow );
 	}
 }
 
+int CellDetector::getCellIndex( const vec2 &pos ) const
+{
+	const ivec2 pixel( glm::floor( pos * vec2( mLastFrameSize ) ) );
+	if ( ( pixel.x < 0 ) || ( pixel.y < 0 ) || ( pixel.x >= mLastFrameSize.x ) || ( pixel.y >= mLastFrameSize.y ) ||
+		 mCellLabels.empty() )
+	{
+		return -1;
+	}
+	const uint16_t label = mCellLabels[ size_t( pixel.y ) * mLastFrameSize.x + pixel.x ];
+	return ( label < mLastGridSize * mLastGridSize ) ? label : -1;
+}
+
 vec2 CellDetector::getCellCenter( const ivec2 &cellPos )
 {
-	return mNormalizedToScreenMapping.map( mGridCells[ cellPos.y ][ cellPos. x ].getCenter() );
+	DrawStateRef drawState = std::atomic_load( &mDrawState );
+	if ( ! drawState || ( size_t( cellPos.x ) >= drawState->mGridSize ) ||
+		 ( size_t( cellPos.y ) >= drawState->mGridSize ) )
+	{
+		return vec2( 0.0f );
+	}
+	const size_t numPoints = drawState->mGridSize + 1;
+	const auto &points = drawState->mGridPoints;
+	const size_t i = cellPos.y * numPoints + cellPos.x;
+	const vec2 center = ( points[ i ] + points[ i + 1 ] + points[ i + numPoints ] + points[ i + numPoints + 1 ] ) * 0.25f;
+	return mNormalizedToScreenMapping.map( center );
 }
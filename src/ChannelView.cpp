@@ -1,68 +1,356 @@
+#include <algorithm>
+#include <iterator>
+
+#include "cinder/Log.h"
 #include "cinder/app/App.h"
 #include "cinder/ip/Fill.h"
 #include "GlobalData.h"
 #include "ChannelView.h"
+#include "GridKernels.h"
 
 using namespace ci;
 using namespace ci::app;
 using namespace std;
 
-ChannelView::ChannelView(){};
+namespace {
+
+//! Orders control points for the multiset difference of two control point lists.
+bool lessControlPoint( const ivec2 &a, const ivec2 &b ) {
+    return ( a.y < b.y ) || ( a.y == b.y && a.x < b.x );
+}
+
+} // anonymous namespace
+
+ChannelView::ChannelView() : mResult( new Result() ) {};
 
 void ChannelView::setup() {
     offset = vec2(getWindowWidth() / 4, getWindowHeight() / 2 ) ;
-    customChannel = Surface8u( loadImage( loadResource( C_IMAGE ) ) ).getChannelRed();
     baseChannel = loadImage( loadResource( BASE_IMAGE ) ) ;
     bpmChannel = loadImage( loadResource( BASE_IMAGE ) ) ;
+    // all patterns are decoded and baked once, switching between them only selects the stamp
+    loadStamp( "pattern", loadResource( C_IMAGE ) );
+    loadStamp( "custom", loadResource( CUSTOM_PATTERN_IMAGE ) );
+    bakeStamps();
     
     GlobalData &gd = GlobalData::get();
     mParams = params::InterfaceGl::create("BPM", ivec2(200,400));
     mParams->setPosition(ivec2(16,332));
-    for( size_t i = 0; i < mBpmValues.size(); i++) {
-        mParams->addParam( "Bpm #" + to_string(i), &mBpmValues[i]).min( 1 ).max( 220 );
-        gd.mConfig->addVar( "ChannelView.Bpm" + to_string(i), &mBpmValues[i], mBpmValues[i] );
+    // the params and the config edit a copy on the ui thread, see commitParams()
+    Settings &settings = mParamSettings;
+    settings.mBpmValues = mBpmValues;
+    for( size_t i = 0; i < settings.mBpmValues.size(); i++) {
+        mParams->addParam( "Bpm #" + to_string(i), &settings.mBpmValues[i]).min( 1 ).max( 220 );
+        gd.mConfig->addVar( "ChannelView.Bpm" + to_string(i), &settings.mBpmValues[i], settings.mBpmValues[i] );
     }
+    mParams->addSeparator();
+    mParams->addParam( "Pattern", mPatternNames, &settings.mPatternId );
+    mParams->addParam( "Pattern crossfade", &settings.mPatternCrossfade ).min( 0.0f ).max( 30.0f ).step( 0.1f );
+    gd.mConfig->addVar( "ChannelView.Pattern", &settings.mPatternId, 0 );
+    gd.mConfig->addVar( "ChannelView.PatternCrossfade", &settings.mPatternCrossfade, 2.0f );
+    mParams->addSeparator();
+    mParams->addParam( "Field cache size", &settings.mFieldCacheCapacity ).min( 0 ).max( 4096 );
+    mParams->addParam( "Field cache hits", &mFieldCacheHits, true );
+    mParams->addParam( "Field cache misses", &mFieldCacheMisses, true );
+    gd.mConfig->addVar( "ChannelView.FieldCacheSize", &settings.mFieldCacheCapacity, 64 );
+    mParams->addParam( "Incremental update", &settings.mIncrementalEnabled );
+    mParams->addParam( "Verify incremental", &settings.mVerifyEnabled );
+    mParams->addParam( "Verify failures", &mVerifyFailures, true );
+    gd.mConfig->addVar( "ChannelView.Incremental", &settings.mIncrementalEnabled, true );
+    commitParams();
 }
 
-void ChannelView::update( const vector<ivec2> &cps ) {
+void ChannelView::commitParams() {
+    lock_guard< mutex > lock( mSettingsMutex );
+    mPendingSettings = mParamSettings;
+}
+
+void ChannelView::applyParams() {
+    lock_guard< mutex > lock( mSettingsMutex );
+    if( mPendingSettings.mBpmValues != mBpmValues ) {
+        mBpmValues = mPendingSettings.mBpmValues;
+        mBpmValuesChanged = true;
+    }
+    mPatternId = mPendingSettings.mPatternId;
+    mPatternCrossfade = mPendingSettings.mPatternCrossfade;
+    mFieldCacheCapacity = mPendingSettings.mFieldCacheCapacity;
+    mIncrementalEnabled = mPendingSettings.mIncrementalEnabled;
+    mVerifyEnabled = mPendingSettings.mVerifyEnabled;
+}
+
+void ChannelView::update( const vector<ivec2> &cps, uint64_t cpsGeneration, const CellDetector::Occupancy &occupancy ) {
+    const bool patternChanged = updatePattern();
+    if( ! patternChanged && ! mBpmValuesChanged && cpsGeneration == mLastCpsGeneration ) {
+        return;
+    }
+    if( mBpmValuesChanged ) {
+        // cached bpm fields and the running sums were computed with the previous values
+        clearFieldCache();
+        bakeStamps();
+        mSums.mValid = false;
+        mFadeSums.mValid = false;
+    }
+    mBpmValuesChanged = false;
+    mLastCpsGeneration = cpsGeneration;
+    mGeneration++;
+
     controlPoints = cps;
+    const bool fading = mFadePattern >= 0;
+    // cells holding several blobs are stamped more than once, their fields can not be keyed by the occupancy
+    const bool cacheable = ! fading && ( mFieldCacheCapacity > 0 ) && ( occupancy.count() == cps.size() ) && ( cps.size() > 0 );
+    if( cacheable && lookupFieldCache( occupancy ) ) {
+        mFieldCacheHits++;
+    } else {
+        if( mIncrementalEnabled ) {
+            diffControlPoints( cps );
+        }
+        updateSums( mStamps[ mActivePattern ], cps, &mSums );
+        if( fading ) {
+            updateSums( mStamps[ mFadePattern ], cps, &mFadeSums );
+        }
+
+        if( cacheable ) {
+            mFieldCacheMisses++;
+            storeFieldCache( occupancy );
+        }
+    }
+    mStampedPoints = cps;
+
     if( cps.size() > 0 ) {
-		ip::fill( &baseChannel, 0.0f );
-		ip::fill( &bpmChannel, 0.0f );
-
-        //  add customChannel colors to baseChannel
-        for( auto tp : controlPoints ) {
-            vec2 p = vec2(baseChannel.getWidth() - tp.x - 2, baseChannel.getHeight() - tp.y - 2 );
-            Area customArea(p.x, p.y, p.x + baseChannel.getWidth(), p.y + baseChannel.getHeight() );
-            Channel::Iter iter = customChannel.getIter( customArea );
-        
-            while( iter.line() ) {
-                while( iter.pixel() ) {
-                    ivec2 setpos(iter.x() - p.x , iter.y() - p.y ) ;
-                    baseChannel.setValue( setpos, baseChannel.getValue(setpos) + iter.v() );
+        // the bpm maximum of 1640 is applied to the final sums only
+        const int32_t fieldWidth = baseChannel.getWidth();
+        const float t = mFadeAmount;
+        for( int32_t y = 0; y < baseChannel.getHeight(); y++ ) {
+            const float *rawSum = &mSums.mRaw[ y * fieldWidth ];
+            const float *bpmSum = &mSums.mBpm[ y * fieldWidth ];
+            float *base = baseChannel.getData( ivec2( 0, y ) );
+            float *bpm = bpmChannel.getData( ivec2( 0, y ) );
+            if( fading ) {
+                const float *fadeRawSum = &mFadeSums.mRaw[ y * fieldWidth ];
+                const float *fadeBpmSum = &mFadeSums.mBpm[ y * fieldWidth ];
+                for( int32_t x = 0; x < fieldWidth; x++ ) {
+                    base[ x ] = ( 1.0f - t ) * rawSum[ x ] + t * fadeRawSum[ x ];
+                    bpm[ x ] = std::min( ( 1.0f - t ) * bpmSum[ x ] + t * fadeBpmSum[ x ], 1640.0f );
                 }
-            }
-        }
-    
-        //  add corresponding bpm values to bpmChannel
-        for( auto tp : controlPoints ) {
-            vec2 p = vec2(bpmChannel.getWidth() - tp.x - 2, bpmChannel.getHeight() - tp.y - 2 );
-            Area customArea(p.x, p.y, p.x + bpmChannel.getWidth(), p.y + bpmChannel.getHeight() );
-            Channel::Iter iter = customChannel.getIter( customArea );
-        
-            while( iter.line() ) {
-                while( iter.pixel() ) {
-                    ivec2 setpos(iter.x() - p.x , iter.y() - p.y ) ;
-                    //  max bpm: 1640
-                    if( bpmChannel.getValue(setpos) + mBpmValues[iter.v()/10 - 1] < 1640 ) {
-                        bpmChannel.setValue( setpos, bpmChannel.getValue(setpos) + mBpmValues[iter.v()/10 - 1] );
-                    }
+            } else {
+                for( int32_t x = 0; x < fieldWidth; x++ ) {
+                    base[ x ] = rawSum[ x ];
+                    bpm[ x ] = std::min( bpmSum[ x ], 1640.0f );
                 }
             }
         }
     } else {
 		ip::fill( &bpmChannel, 60.0f );
     }
+
+    publishResult();
+}
+
+bool ChannelView::updatePattern() {
+    const int requestedPattern = glm::clamp( mPatternId, 0, int( mStamps.size() ) - 1 );
+    const int targetPattern = ( mFadePattern >= 0 ) ? mFadePattern : mActivePattern;
+    if( requestedPattern != targetPattern ) {
+        // a crossfade interrupted by another pattern continues from the pattern it was fading to
+        if( mFadePattern >= 0 ) {
+            finishFade();
+        }
+        if( mPatternCrossfade > 0.0f ) {
+            mFadePattern = requestedPattern;
+            mFadeSums.mValid = false;
+            mFadeStart = getElapsedSeconds();
+            mFadeAmount = 0.0f;
+        } else {
+            mActivePattern = requestedPattern;
+            mSums.mValid = false;
+            clearFieldCache();
+        }
+        return true;
+    }
+
+    if( mFadePattern >= 0 ) {
+        mFadeAmount = ( mPatternCrossfade > 0.0f ) ? float( ( getElapsedSeconds() - mFadeStart ) / mPatternCrossfade ) : 1.0f;
+        if( mFadeAmount >= 1.0f ) {
+            finishFade();
+        }
+        return true;
+    }
+    return false;
+}
+
+void ChannelView::finishFade() {
+    // the sums of the pattern faded to are up to date, they become the active ones
+    mActivePattern = mFadePattern;
+    std::swap( mSums, mFadeSums );
+    mFadePattern = -1;
+    mFadeAmount = 0.0f;
+    clearFieldCache();
+}
+
+void ChannelView::publishResult() {
+    std::shared_ptr< Result > result;
+    for( const auto &r : mResultPool ) {
+        // only referenced by the pool, neither published nor held by a consumer
+        if( r.use_count() == 1 ) {
+            result = r;
+            break;
+        }
+    }
+    if( ! result ) {
+        result = std::make_shared< Result >();
+        mResultPool.push_back( result );
+    }
+
+    // the bpm channel has the size of the base channel, both are loaded from the base image
+    const size_t numValues = baseChannel.getWidth() * baseChannel.getHeight();
+    result->mSize = baseChannel.getSize();
+    result->mRaw.resize( numValues );
+    result->mBpm.resize( numValues );
+    result->mBpmEven.resize( ( numValues + 1 ) / 2 );
+    result->mBpmOdd.resize( numValues / 2 );
+    gridkernels::fieldResult( baseChannel.getData(), baseChannel.getRowBytes() / sizeof( float ),
+                              bpmChannel.getData(), bpmChannel.getRowBytes() / sizeof( float ),
+                              result->mRaw.data(), result->mBpm.data(), result->mBpmEven.data(), result->mBpmOdd.data(),
+                              baseChannel.getWidth(), baseChannel.getHeight() );
+    result->mVersion = mGeneration;
+
+    mResult = result;
+}
+
+void ChannelView::loadStamp( const string &name, const DataSourceRef &source ) {
+    Channel8u channel = Surface8u( loadImage( source ) ).getChannelRed();
+
+    Stamp stamp;
+    stamp.mName = name;
+    stamp.mSize = channel.getSize();
+    stamp.mCenter = ( stamp.mSize - ivec2( 1 ) ) / 2;
+    stamp.mRaw.resize( stamp.mSize.x * stamp.mSize.y );
+    stamp.mBpmIndex.resize( stamp.mSize.x * stamp.mSize.y );
+
+    // pattern values 10, 20, ... select the bpm values, others do not contribute
+    size_t numUncoded = 0;
+    for( int32_t y = 0; y < stamp.mSize.y; y++ ) {
+        for( int32_t x = 0; x < stamp.mSize.x; x++ ) {
+            const uint8_t v = channel.getValue( ivec2( x, y ) );
+            const int bpmIndex = v / 10 - 1;
+            const bool selects = bpmIndex >= 0 && bpmIndex < int( mBpmValues.size() );
+            stamp.mRaw[ y * stamp.mSize.x + x ] = v;
+            stamp.mBpmIndex[ y * stamp.mSize.x + x ] = selects ? int8_t( bpmIndex ) : -1;
+            // plain gray images bake into a field, but their bpm values are arbitrary
+            if( v != 0 && ( ! selects || v % 10 != 0 ) ) {
+                numUncoded++;
+            }
+        }
+    }
+    if( numUncoded > 0 ) {
+        CI_LOG_W( "pattern " << name << " has " << numUncoded << " pixels that do not code a bpm value" );
+    }
+
+    mStamps.push_back( stamp );
+    mPatternNames.push_back( name );
+}
+
+void ChannelView::bakeStamps() {
+    for( auto &stamp : mStamps ) {
+        stamp.mBpm.resize( stamp.mBpmIndex.size() );
+        for( size_t i = 0; i < stamp.mBpmIndex.size(); i++ ) {
+            stamp.mBpm[ i ] = ( stamp.mBpmIndex[ i ] >= 0 ) ? float( mBpmValues[ stamp.mBpmIndex[ i ] ] ) : 0.0f;
+        }
+    }
+}
+
+void ChannelView::accumulateStamp( const Stamp &stamp, const ivec2 &tp, float weight, FieldSums *sums ) {
+    // the stamp center is placed on the control point
+    const ivec2 origin = stamp.mCenter - tp;
+    gridkernels::stampAccumulate( stamp.mRaw.data(), stamp.mBpm.data(), stamp.mSize.x, stamp.mSize.y,
+                                  origin.x, origin.y, weight, sums->mRaw.data(), sums->mBpm.data(),
+                                  baseChannel.getWidth(), baseChannel.getHeight() );
+}
+
+void ChannelView::recomputeSums( const Stamp &stamp, const vector<ivec2> &cps, FieldSums *sums ) {
+    const size_t fieldSize = baseChannel.getWidth() * baseChannel.getHeight();
+    sums->mRaw.assign( fieldSize, 0.0f );
+    sums->mBpm.assign( fieldSize, 0.0f );
+    for( const auto &tp : cps ) {
+        accumulateStamp( stamp, tp, 1.0f, sums );
+    }
+    sums->mValid = true;
+}
+
+void ChannelView::diffControlPoints( const vector<ivec2> &cps ) {
+    mSortedPoints = cps;
+    mSortedStampedPoints = mStampedPoints;
+    std::sort( mSortedPoints.begin(), mSortedPoints.end(), lessControlPoint );
+    std::sort( mSortedStampedPoints.begin(), mSortedStampedPoints.end(), lessControlPoint );
+
+    mAddedPoints.clear();
+    mRemovedPoints.clear();
+    std::set_difference( mSortedPoints.begin(), mSortedPoints.end(),
+                         mSortedStampedPoints.begin(), mSortedStampedPoints.end(),
+                         std::back_inserter( mAddedPoints ), lessControlPoint );
+    std::set_difference( mSortedStampedPoints.begin(), mSortedStampedPoints.end(),
+                         mSortedPoints.begin(), mSortedPoints.end(),
+                         std::back_inserter( mRemovedPoints ), lessControlPoint );
+}
+
+void ChannelView::updateSums( const Stamp &stamp, const vector<ivec2> &cps, FieldSums *sums ) {
+    // stamping everything is cheaper when most of the points have changed
+    if( ! mIncrementalEnabled || ! sums->mValid || ( mAddedPoints.size() + mRemovedPoints.size() >= cps.size() ) ) {
+        recomputeSums( stamp, cps, sums );
+    } else {
+        for( const auto &tp : mRemovedPoints ) {
+            accumulateStamp( stamp, tp, -1.0f, sums );
+        }
+        for( const auto &tp : mAddedPoints ) {
+            accumulateStamp( stamp, tp, 1.0f, sums );
+        }
+    }
+
+    if( mVerifyEnabled ) {
+        verifySums( stamp, cps, sums );
+    }
+}
+
+void ChannelView::verifySums( const Stamp &stamp, const vector<ivec2> &cps, FieldSums *sums ) {
+    recomputeSums( stamp, cps, &mVerifySums );
+    if( mVerifySums.mRaw != sums->mRaw || mVerifySums.mBpm != sums->mBpm ) {
+        mVerifyFailures++;
+        CI_LOG_E( "incremental bpm field of pattern " << stamp.mName << " differs from the full recompute" );
+        std::swap( *sums, mVerifySums );
+    }
+}
+
+bool ChannelView::lookupFieldCache( const CellDetector::Occupancy &occupancy ) {
+    auto it = mFieldCacheIndex.find( occupancy );
+    if( it == mFieldCacheIndex.end() ) {
+        return false;
+    }
+    mFieldCache.splice( mFieldCache.begin(), mFieldCache, it->second );
+    mSums = it->second->mSums;
+    return true;
+}
+
+void ChannelView::storeFieldCache( const CellDetector::Occupancy &occupancy ) {
+    while( mFieldCache.size() > size_t( mFieldCacheCapacity ) ) {
+        mFieldCacheIndex.erase( mFieldCache.back().mOccupancy );
+        mFieldCache.pop_back();
+    }
+
+    // the least recently used entry is reused when the cache is full, which keeps its buffers
+    if( mFieldCache.size() == size_t( mFieldCacheCapacity ) ) {
+        mFieldCacheIndex.erase( mFieldCache.back().mOccupancy );
+        mFieldCache.splice( mFieldCache.begin(), mFieldCache, std::prev( mFieldCache.end() ) );
+    } else {
+        mFieldCache.emplace_front();
+    }
+
+    FieldCacheEntry &entry = mFieldCache.front();
+    entry.mOccupancy = occupancy;
+    entry.mSums = mSums;
+    mFieldCacheIndex[ occupancy ] = mFieldCache.begin();
+}
+
+void ChannelView::clearFieldCache() {
+    mFieldCache.clear();
+    mFieldCacheIndex.clear();
 }
 
 float ChannelView::remap( float val, float inMin, float inMax, float outMin, float outMax ) {
@@ -71,28 +359,16 @@ float ChannelView::remap( float val, float inMin, float inMax, float outMin, flo
 
 string ChannelView::getRawResultAsString() {
     string baseChannelGrayValues = "";
-    
-    Area area( 0, 0, baseChannel.getWidth(), baseChannel.getHeight() );
-    Channel32f::Iter iter = baseChannel.getIter( area );
-    while( iter.line() ) {
-        while( iter.pixel() ) {
-            float baseValue = iter.v() / 10;
-            baseChannelGrayValues.append( to_string( ( int )baseValue ) + " " );
-        }
+    for( int rawValue : mResult->mRaw ) {
+        baseChannelGrayValues.append( to_string( rawValue ) + " " );
     }
     return baseChannelGrayValues;
 }
 
 string ChannelView::getBpmResultAsString() {
     string bpmValues = "_S ";
-    
-    Area area( 0, 0, bpmChannel.getWidth(), bpmChannel.getHeight() );
-    Channel32f::Iter iter = bpmChannel.getIter( area );
-    while( iter.line() ) {
-        while( iter.pixel() ) {
-            int bpmValue = iter.v();
-            bpmValues.append( to_string( bpmValue ) + " " );
-        }
+    for( int bpmValue : mResult->mBpm ) {
+        bpmValues.append( to_string( bpmValue ) + " " );
     }
     bpmValues.append( "\n" );
     return bpmValues;
@@ -148,71 +424,3 @@ std::vector< string > ChannelView::getBpmResultAsFixedMultiString() {
     
     return multiStrings;
 }
-
-std::vector< int > ChannelView::getRawResultAsVector() {
-    std::vector< int > rawResult;
-    Area area( 0, 0, baseChannel.getWidth(), baseChannel.getHeight() );
-    Channel32f::Iter iter = baseChannel.getIter( area );
-    while( iter.line() ) {
-        while( iter.pixel() ) {
-            float baseValue = iter.v() / 10;
-            rawResult.push_back( ( int )baseValue );
-        }
-    }
-    return rawResult;
-}
-
-std::vector< int > ChannelView::getBpmResultAsVector() {
-    std::vector< int > bpmResult;
-    
-    Area area( 0, 0, bpmChannel.getWidth(), bpmChannel.getHeight() );
-    Channel32f::Iter iter = bpmChannel.getIter( area );
-    while( iter.line() ) {
-        while( iter.pixel() ) {
-            float val = iter.v();
-            bpmResult.push_back( ( int )val );
-        }
-    }
-    return bpmResult;
-}
-
-std::vector< int >  ChannelView::getBpmResultAsVectorEven() {
-    std::vector< int > bpmResultsEven;
-    
-    Area area( 0, 0, bpmChannel.getWidth(), bpmChannel.getHeight() );
-    Channel32f::Iter iter = bpmChannel.getIter( area );
-    int c = 0;
-    while( iter.line() ) {
-        while( iter.pixel() ) {
-            float val = iter.v();
-            if( c % 2 == 0 ) {
-               bpmResultsEven.push_back( ( int )val );
-            }
-            c++;
-        }
-    }
-    return bpmResultsEven;
-}
-
-std::vector< int >  ChannelView::getBpmResultAsVectorOdd() {
-    std::vector< int > bpmResultsOdd;
-    
-    Area area( 0, 0, bpmChannel.getWidth(), bpmChannel.getHeight() );
-    Channel32f::Iter iter = bpmChannel.getIter( area );
-    int c = 0;
-    while( iter.line() ) {
-        while( iter.pixel() ) {
-            float val = iter.v();
-            if( c % 2 == 1 ) {
-                bpmResultsOdd.push_back( ( int )val );
-            }
-            c++;
-        }
-    }
-    return bpmResultsOdd;
-}
-
-
-
-
-
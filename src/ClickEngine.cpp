@@ -0,0 +1,205 @@
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#include "ClickEngine.h"
+
+constexpr float ClickEngine::kMinCenterFreq;
+
+void ClickEngine::setup( size_t numVoices, float sampleRate, size_t numChannels )
+{
+	mSampleRate = sampleRate;
+	mNumChannels = std::max< size_t >( numChannels, 1 );
+	mSampleTime = 0;
+	mStartTime = 0;
+
+	mPeriod.assign( numVoices, 0.0 );
+	mNextTick.assign( numVoices, std::numeric_limits< double >::infinity() );
+	mClickIndex.assign( numVoices, 0 );
+	mVoiceGain.assign( numVoices, 1.0f );
+	mPlayingClicks.resize( 2 * numVoices );
+	mNumPlayingClicks = 0;
+
+	renderBank( 4.0f );
+}
+
+void ClickEngine::renderBank( float q )
+{
+	mBankSamples.clear();
+	mBankOffsets.clear();
+	mBankLengths.clear();
+
+	// a click fades out below this fraction of its peak or is cut after maxLength samples
+	const float kThreshold = 1e-4f;
+	const size_t maxLength = size_t( 0.05f * mSampleRate );
+	const float semitone = std::pow( 2.0f, 1.0f / 12.0f );
+	for ( float centerFreq = kMinCenterFreq; centerFreq < 0.45f * mSampleRate; centerFreq *= semitone )
+	{
+		// same band-pass as MetronomeSynth
+		const float w0 = 2.0f * float( M_PI ) * centerFreq / mSampleRate;
+		const float alpha = std::sin( w0 ) / ( 2.0f * q );
+		const float a0 = 1.0f + alpha;
+		const float b0 = alpha / a0;
+		const float a1 = -2.0f * std::cos( w0 ) / a0;
+		const float a2 = ( 1.0f - alpha ) / a0;
+
+		// the filter settled on the phase just below 1 rings after the phase wraps to 0
+		float z1 = -b0;
+		float z2 = -b0;
+		const size_t offset = mBankSamples.size();
+		float peak = 0.0f;
+		size_t quietFrames = 0;
+		for ( size_t i = 0; ( i < maxLength ) && ( quietFrames < 64 ); i++ )
+		{
+			const float y = z1;
+			z1 = z2 - a1 * y;
+			z2 = -a2 * y;
+			mBankSamples.push_back( y );
+			peak = std::max( peak, std::abs( y ) );
+			quietFrames = ( std::abs( y ) < kThreshold * peak ) ? quietFrames + 1 : 0;
+		}
+		mBankOffsets.push_back( uint32_t( offset ) );
+		mBankLengths.push_back( uint32_t( mBankSamples.size() - offset ) );
+	}
+}
+
+uint16_t ClickEngine::getClickIndex( float centerFreq ) const
+{
+	if ( mBankLengths.empty() || ( centerFreq <= kMinCenterFreq ) )
+	{
+		return 0;
+	}
+	const float semitones = std::round( 12.0f * std::log2( centerFreq / kMinCenterFreq ) );
+	return uint16_t( std::min( semitones, float( mBankLengths.size() - 1 ) ) );
+}
+
+void ClickEngine::setVoice( size_t i, float freq, float centerFreq )
+{
+	mClickIndex[ i ] = getClickIndex( centerFreq );
+	const double period = ( freq > 0.0f ) ? mSampleRate / double( freq ) : 0.0;
+	if ( period != mPeriod[ i ] )
+	{
+		mPeriod[ i ] = period;
+		scheduleNextTick( i );
+	}
+}
+
+void ClickEngine::bendVoice( size_t i, float freq )
+{
+	const double period = ( freq > 0.0f ) ? mSampleRate / double( freq ) : 0.0;
+	if ( period == mPeriod[ i ] )
+	{
+		return;
+	}
+
+	if ( mPeriod[ i ] <= 0.0 )
+	{
+		// a silent voice has no last tick, it starts on the grid
+		mPeriod[ i ] = period;
+		scheduleNextTick( i );
+		return;
+	}
+
+	const double lastTick = mNextTick[ i ] - mPeriod[ i ];
+	mPeriod[ i ] = period;
+	mNextTick[ i ] = ( period > 0.0 ) ? std::max( lastTick + period, double( mSampleTime ) )
+									  : std::numeric_limits< double >::infinity();
+}
+
+void ClickEngine::restart( uint64_t sampleTime )
+{
+	mStartTime = sampleTime;
+	for ( size_t i = 0; i < mPeriod.size(); i++ )
+	{
+		scheduleNextTick( i );
+	}
+}
+
+void ClickEngine::scheduleNextTick( size_t i )
+{
+	if ( mPeriod[ i ] <= 0.0 )
+	{
+		mNextTick[ i ] = std::numeric_limits< double >::infinity();
+		return;
+	}
+	// the first tick at or after the current time on the grid of the start time
+	const double ticks = std::ceil( double( mSampleTime - mStartTime ) / mPeriod[ i ] );
+	mNextTick[ i ] = double( mStartTime ) + ticks * mPeriod[ i ];
+}
+
+void ClickEngine::process( float *const *channels, size_t numFrames, float gain )
+{
+	const uint64_t blockEnd = mSampleTime + numFrames;
+	const double blockEndTime = double( blockEnd );
+
+	for ( size_t i = 0; i < mNextTick.size(); i++ )
+	{
+		while ( mNextTick[ i ] < blockEndTime )
+		{
+			if ( mNumPlayingClicks < mPlayingClicks.size() )
+			{
+				// rounded to the nearest sample, which may be the first one of the next block
+				const uint64_t tick = uint64_t( std::llround( mNextTick[ i ] ) );
+				PlayingClick &click = mPlayingClicks[ mNumPlayingClicks++ ];
+				click.mOffset = mBankOffsets[ mClickIndex[ i ] ];
+				click.mRemaining = mBankLengths[ mClickIndex[ i ] ];
+				click.mDelay = uint32_t( ( tick > mSampleTime ) ? tick - mSampleTime : 0 );
+				click.mChannel = uint32_t( i % mNumChannels );
+				click.mGain = gain * mVoiceGain[ i ];
+			}
+			else
+			{
+				mNumDroppedClicks++;
+			}
+			mNextTick[ i ] += mPeriod[ i ];
+		}
+	}
+
+	for ( size_t c = 0; c < mNumPlayingClicks; )
+	{
+		PlayingClick &click = mPlayingClicks[ c ];
+		if ( click.mDelay >= numFrames )
+		{
+			click.mDelay -= uint32_t( numFrames );
+			c++;
+			continue;
+		}
+
+		const size_t count = std::min( numFrames - click.mDelay, size_t( click.mRemaining ) );
+		const float *samples = &mBankSamples[ click.mOffset ];
+		float *dst = channels[ click.mChannel ] + click.mDelay;
+		const float clickGain = click.mGain;
+		for ( size_t f = 0; f < count; f++ )
+		{
+			dst[ f ] += clickGain * samples[ f ];
+		}
+		click.mOffset += uint32_t( count );
+		click.mRemaining -= uint32_t( count );
+		click.mDelay = 0;
+
+		if ( click.mRemaining == 0 )
+		{
+			// finished clicks are replaced by the last one
+			click = mPlayingClicks[ --mNumPlayingClicks ];
+		}
+		else
+		{
+			c++;
+		}
+	}
+
+	mSampleTime = blockEnd;
+}
+
+void ClickEngine::advance( size_t numFrames )
+{
+	mSampleTime += numFrames;
+	mNumPlayingClicks = 0;
+	for ( size_t i = 0; i < mNextTick.size(); i++ )
+	{
+		if ( mNextTick[ i ] < double( mSampleTime ) )
+		{
+			scheduleNextTick( i );
+		}
+	}
+}
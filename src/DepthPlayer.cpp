@@ -0,0 +1,299 @@
+#include <algorithm>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "DepthPlayer.h"
+
+using namespace ci;
+using namespace depthrecording;
+
+DepthPlayer::DepthPlayer( const fs::path &path )
+{
+	mFd = open( path.string().c_str(), O_RDONLY );
+	if ( mFd < 0 )
+	{
+		throw ExcDepthRecording( "Could not open " + path.string() );
+	}
+
+	struct stat st;
+	if ( ( fstat( mFd, &st ) != 0 ) || ( size_t( st.st_size ) < sizeof( FileHeader ) ) )
+	{
+		close( mFd );
+		throw ExcDepthRecording( "Invalid recording " + path.string() );
+	}
+	mSize = st.st_size;
+
+	// private writable mapping, frames are shared with the file unless a consumer writes into them
+	void *data = mmap( nullptr, mSize, PROT_READ | PROT_WRITE, MAP_PRIVATE, mFd, 0 );
+	if ( data == MAP_FAILED )
+	{
+		close( mFd );
+		throw ExcDepthRecording( "Could not map " + path.string() );
+	}
+	mData = static_cast< uint8_t * >( data );
+
+	const FileHeader *header = reinterpret_cast< const FileHeader * >( mData );
+	const size_t camerasEnd = sizeof( FileHeader ) + header->mNumCameras * sizeof( CameraInfo );
+	if ( ( std::memcmp( header->mMagic, kMagic, sizeof( kMagic ) ) != 0 ) ||
+		 ( header->mVersion != kVersion ) ||
+		 ( header->mIndexOffset == 0 ) ||
+		 ( camerasEnd > mSize ) ||
+		 ( header->mIndexOffset > mSize ) ||
+		 // compared by division, the size of a corrupt index could overflow
+		 ( header->mNumFrames > ( mSize - header->mIndexOffset ) / sizeof( IndexEntry ) ) )
+	{
+		munmap( mData, mSize );
+		close( mFd );
+		throw ExcDepthRecording( "Invalid or unfinished recording " + path.string() );
+	}
+
+	mCameras = reinterpret_cast< const CameraInfo * >( mData + sizeof( FileHeader ) );
+	mIndex = reinterpret_cast< const IndexEntry * >( mData + header->mIndexOffset );
+	mNumFrames = header->mNumFrames;
+
+	// the frame sizes are used for the decode buffers and the channels, a corrupt size must not reach them
+	for ( uint32_t i = 0; i < header->mNumCameras; i++ )
+	{
+		const CameraInfo &info = mCameras[ i ];
+		const bool validFormat =
+			( ( info.mPixelFormat == PIXEL_FORMAT_DEPTH8 ) && ( info.mBytesPerPixel == 1 ) ) ||
+			( ( info.mPixelFormat == PIXEL_FORMAT_DEPTH16 ) && ( info.mBytesPerPixel == 2 ) );
+		if ( ( info.mWidth <= 0 ) || ( info.mWidth > kMaxFrameWidth ) ||
+			 ( info.mHeight <= 0 ) || ( info.mHeight > kMaxFrameHeight ) || ! validFormat )
+		{
+			munmap( mData, mSize );
+			close( mFd );
+			throw ExcDepthRecording( "Invalid camera size in recording " + path.string() );
+		}
+	}
+
+	// the playback indexes the cameras by the ids of the index without further checks
+	for ( uint64_t i = 0; i < mNumFrames; i++ )
+	{
+		if ( mIndex[ i ].mCameraId >= header->mNumCameras )
+		{
+			munmap( mData, mSize );
+			close( mFd );
+			throw ExcDepthRecording( "Invalid camera in recording " + path.string() );
+		}
+	}
+
+	mFrames.resize( header->mNumCameras );
+	mDecodeBuffers.resize( header->mNumCameras );
+	mDepthChannels.resize( header->mNumCameras );
+	for ( uint32_t i = 0; i < header->mNumCameras; i++ )
+	{
+		const CameraInfo &info = mCameras[ i ];
+		if ( info.mPixelFormat == PIXEL_FORMAT_DEPTH16 )
+		{
+			// the band mask is the only channel of the camera the player owns
+			mFrames[ i ].mChannel = Channel8u::create( info.mWidth, info.mHeight );
+			mFrames[ i ].mDepthBand = true;
+		}
+		else
+		{
+			mFrames[ i ].mChannel = std::make_shared< Channel8u >();
+		}
+	}
+	mCameraUpdated.resize( header->mNumCameras );
+}
+
+DepthPlayer::~DepthPlayer()
+{
+	munmap( mData, mSize );
+	close( mFd );
+}
+
+std::string DepthPlayer::getCameraLabel( size_t cameraId ) const
+{
+	const char *label = mCameras[ cameraId ].mLabel;
+	return std::string( label, strnlen( label, sizeof( mCameras[ cameraId ].mLabel ) ) );
+}
+
+bool DepthPlayer::setDepthBand( uint16_t nearMm, uint16_t farMm )
+{
+	if ( ( nearMm == mDepthNear ) && ( farMm == mDepthFar ) )
+	{
+		return false;
+	}
+	mDepthNear = nearMm;
+	mDepthFar = farMm;
+
+	bool updated = false;
+	for ( size_t i = 0; i < mFrames.size(); i++ )
+	{
+		if ( mDepthChannels[ i ].getData() )
+		{
+			depthBandMask( mDepthChannels[ i ], mDepthNear, mDepthFar, mFrames[ i ].mChannel.get() );
+			updated = true;
+		}
+	}
+	return updated;
+}
+
+double DepthPlayer::getDuration() const
+{
+	if ( mNumFrames == 0 )
+	{
+		return 0.0;
+	}
+	return mIndex[ mNumFrames - 1 ].mTimestamp - mIndex[ 0 ].mTimestamp;
+}
+
+bool DepthPlayer::update( double time )
+{
+	if ( mNumFrames == 0 )
+	{
+		return false;
+	}
+
+	bool updated = false;
+	if ( mRealtime )
+	{
+		if ( mStartTime < 0.0 )
+		{
+			mStartTime = time - mIndex[ mNextFrameId ].mTimestamp;
+		}
+
+		const double recordingTime = time - mStartTime;
+		while ( ( mNextFrameId < mNumFrames ) && ( mIndex[ mNextFrameId ].mTimestamp <= recordingTime ) )
+		{
+			playFrame( mNextFrameId++ );
+			updated = true;
+		}
+	}
+	else
+	{
+		// one frame per camera
+		std::fill( mCameraUpdated.begin(), mCameraUpdated.end(), false );
+		while ( mNextFrameId < mNumFrames )
+		{
+			uint32_t cameraId = mIndex[ mNextFrameId ].mCameraId;
+			if ( mCameraUpdated[ cameraId ] )
+			{
+				break;
+			}
+			playFrame( mNextFrameId++ );
+			mCameraUpdated[ cameraId ] = true;
+			updated = true;
+		}
+	}
+
+	if ( mNextFrameId >= mNumFrames )
+	{
+		mNextFrameId = 0;
+		mStartTime = -1.0;
+	}
+
+	return updated;
+}
+
+void DepthPlayer::seek( double recordingTime )
+{
+	if ( mNumFrames == 0 )
+	{
+		return;
+	}
+
+	const double timestamp = mIndex[ 0 ].mTimestamp + recordingTime;
+	const IndexEntry *it = std::lower_bound( mIndex, mIndex + mNumFrames, timestamp,
+			[]( const IndexEntry &entry, double t )
+			{
+				return entry.mTimestamp < t;
+			} );
+	mNextFrameId = std::min< size_t >( it - mIndex, mNumFrames - 1 );
+	mStartTime = -1.0;
+
+	// show the last frame of each camera before the seek position
+	std::fill( mCameraUpdated.begin(), mCameraUpdated.end(), false );
+	for ( size_t i = mNextFrameId; i-- > 0; )
+	{
+		uint32_t cameraId = mIndex[ i ].mCameraId;
+		if ( ! mCameraUpdated[ cameraId ] )
+		{
+			playFrame( i );
+			mCameraUpdated[ cameraId ] = true;
+		}
+	}
+}
+
+void DepthPlayer::playFrame( size_t frameId )
+{
+	const IndexEntry &entry = mIndex[ frameId ];
+	if ( ( entry.mCameraId >= mFrames.size() ) ||
+		 ( entry.mOffset > mSize ) || ( sizeof( FrameHeader ) > mSize - entry.mOffset ) )
+	{
+		return;
+	}
+
+	const FrameHeader *header = reinterpret_cast< const FrameHeader * >( mData + entry.mOffset );
+	uint8_t *data = mData + entry.mOffset + sizeof( FrameHeader );
+	const CameraInfo &info = mCameras[ entry.mCameraId ];
+	const bool depth16 = ( info.mPixelFormat == PIXEL_FORMAT_DEPTH16 );
+	const uint64_t frameSize = uint64_t( info.mWidth ) * info.mHeight * info.mBytesPerPixel;
+	if ( ( header->mCameraId != entry.mCameraId ) ||
+		 ( header->mDataSize > mSize - entry.mOffset - sizeof( FrameHeader ) ) )
+	{
+		return;
+	}
+
+	Frame &frame = mFrames[ entry.mCameraId ];
+	if ( header->mEncoding == ENCODING_RAW )
+	{
+		// the writer pads frames to 8 bytes, 16-bit pixels of a corrupt offset would be misaligned
+		if ( ( header->mDataSize != frameSize ) || ( depth16 && ( entry.mOffset & 1 ) ) )
+		{
+			return;
+		}
+		// the channel points into the mapping, no pixels are copied
+		if ( depth16 )
+		{
+			mDepthChannels[ entry.mCameraId ] = Channel16u( info.mWidth, info.mHeight, info.mWidth * 2, 1,
+															 reinterpret_cast< uint16_t * >( data ) );
+		}
+		else
+		{
+			*frame.mChannel = Channel8u( info.mWidth, info.mHeight, info.mWidth, 1, data );
+		}
+	}
+	else
+	if ( header->mEncoding == ENCODING_DELTA_RLE )
+	{
+		std::vector< uint8_t > &buffer = mDecodeBuffers[ entry.mCameraId ];
+		buffer.resize( frameSize );
+		if ( depth16 )
+		{
+			uint16_t *depth = reinterpret_cast< uint16_t * >( buffer.data() );
+			if ( ! decodeDeltaRle( data, header->mDataSize, info.mWidth, info.mHeight, depth ) )
+			{
+				return;
+			}
+			mDepthChannels[ entry.mCameraId ] = Channel16u( info.mWidth, info.mHeight, info.mWidth * 2, 1, depth );
+		}
+		else
+		{
+			if ( ! decodeDeltaRle( data, header->mDataSize, info.mWidth, info.mHeight, buffer.data() ) )
+			{
+				return;
+			}
+			*frame.mChannel = Channel8u( info.mWidth, info.mHeight, info.mWidth, 1, buffer.data() );
+		}
+	}
+	else
+	{
+		return;
+	}
+
+	if ( depth16 )
+	{
+		depthBandMask( mDepthChannels[ entry.mCameraId ], mDepthNear, mDepthFar, frame.mChannel.get() );
+	}
+
+	frame.mSequence = header->mSequence;
+	frame.mTimestamp = header->mTimestamp;
+	mPosition = header->mTimestamp - mIndex[ 0 ].mTimestamp;
+}
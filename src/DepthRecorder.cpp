@@ -0,0 +1,207 @@
+#include <limits>
+
+#include "cinder/Log.h"
+#include "cinder/Utilities.h"
+
+#include "DepthRecorder.h"
+
+using namespace ci;
+using namespace depthrecording;
+
+DepthRecorder::CameraQueue::CameraQueue( const DepthRecordingWriter::Camera &camera ) :
+	mFrames( kNumFrames ),
+	mFreeFrames( kNumFrames ),
+	mQueuedFrames( kNumFrames ),
+	mNumDroppedFrames( 0 ),
+	mDepth16( camera.mPixelFormat == PIXEL_FORMAT_DEPTH16 )
+{
+	for ( size_t i = 0; i < kNumFrames; i++ )
+	{
+		if ( mDepth16 )
+		{
+			mFrames[ i ].mDepth = Channel16u( camera.mSize.x, camera.mSize.y );
+		}
+		else
+		{
+			mFrames[ i ].mChannel = Channel8u( camera.mSize.x, camera.mSize.y );
+		}
+		mFreeFrames.push( i );
+	}
+}
+
+DepthRecorder::DepthRecorder( const fs::path &path, const std::vector< DepthRecordingWriter::Camera > &cameras ) :
+	mRunning( true ),
+	mElapsedSeconds( 0.0 ),
+	mNumFrames( 0 ),
+	mRawBytes( 0 ),
+	mEncodedBytes( 0 )
+{
+	mWriter = DepthRecordingWriter::create( path, cameras );
+
+	for ( const auto &camera : cameras )
+	{
+		mCameraQueues.emplace_back( new CameraQueue( camera ) );
+	}
+
+	mStartTime = std::chrono::steady_clock::now();
+	mWriterThread =
+		std::shared_ptr< std::thread >( new std::thread(
+			std::bind( &DepthRecorder::writerThreadFn, this ) ) );
+}
+
+DepthRecorder::~DepthRecorder()
+{
+	stop();
+}
+
+bool DepthRecorder::addFrame( size_t cameraId, uint64_t sequence, double timestamp, const Channel8u &channel )
+{
+	return addChannelFrame( cameraId, sequence, timestamp, channel, &Frame::mChannel );
+}
+
+bool DepthRecorder::addFrame( size_t cameraId, uint64_t sequence, double timestamp, const Channel16u &channel )
+{
+	return addChannelFrame( cameraId, sequence, timestamp, channel, &Frame::mDepth );
+}
+
+template< typename T >
+bool DepthRecorder::addChannelFrame( size_t cameraId, uint64_t sequence, double timestamp, const ChannelT< T > &channel,
+									 ChannelT< T > Frame::*frameChannel )
+{
+	if ( ! mRunning || ( cameraId >= mCameraQueues.size() ) )
+	{
+		return false;
+	}
+
+	CameraQueue &queue = *mCameraQueues[ cameraId ];
+	size_t frameId;
+	// frames are dropped if the camera resolution or pixel format changed
+	// while recording or the writer thread has not caught up yet
+	if ( ( ( queue.mFrames[ 0 ].*frameChannel ).getSize() != channel.getSize() ) ||
+		 ! queue.mFreeFrames.pop( &frameId ) )
+	{
+		queue.mNumDroppedFrames++;
+		return false;
+	}
+
+	Frame &frame = queue.mFrames[ frameId ];
+	( frame.*frameChannel ).copyFrom( channel, channel.getBounds() );
+	frame.mSequence = sequence;
+	frame.mTimestamp = timestamp;
+	queue.mQueuedFrames.push( frameId );
+	return true;
+}
+
+void DepthRecorder::stop()
+{
+	mRunning = false;
+	if ( mWriterThread )
+	{
+		mWriterThread->join();
+		mWriterThread.reset();
+	}
+
+	try
+	{
+		mWriter->finish();
+	}
+	catch ( const ExcDepthRecording &exc )
+	{
+		CI_LOG_E( exc.what() );
+	}
+}
+
+DepthRecorder::Stats DepthRecorder::getStats() const
+{
+	Stats stats;
+	stats.mNumFrames = mNumFrames;
+	for ( const auto &queue : mCameraQueues )
+	{
+		stats.mNumDroppedFrames += queue->mNumDroppedFrames;
+	}
+	stats.mRawBytes = mRawBytes;
+	stats.mEncodedBytes = mEncodedBytes;
+	stats.mElapsedSeconds = mElapsedSeconds;
+	return stats;
+}
+
+void DepthRecorder::writerThreadFn()
+{
+	static const size_t kNone = std::numeric_limits< size_t >::max();
+
+	// one frame per camera is taken out of its queue, the oldest of them is
+	// written first to keep the file close to capture order
+	std::vector< size_t > pendingFrames( mCameraQueues.size(), kNone );
+
+	while ( true )
+	{
+		// frames queued before stop() are still written
+		const bool running = mRunning;
+
+		size_t oldestCameraId = kNone;
+		double oldestTimestamp = std::numeric_limits< double >::max();
+		for ( size_t i = 0; i < mCameraQueues.size(); i++ )
+		{
+			if ( pendingFrames[ i ] == kNone )
+			{
+				mCameraQueues[ i ]->mQueuedFrames.pop( &pendingFrames[ i ] );
+			}
+			if ( pendingFrames[ i ] != kNone )
+			{
+				double timestamp = mCameraQueues[ i ]->mFrames[ pendingFrames[ i ] ].mTimestamp;
+				if ( timestamp < oldestTimestamp )
+				{
+					oldestTimestamp = timestamp;
+					oldestCameraId = i;
+				}
+			}
+		}
+
+		if ( oldestCameraId != kNone )
+		{
+			try
+			{
+				writeFrame( oldestCameraId, pendingFrames[ oldestCameraId ] );
+			}
+			catch ( const ExcDepthRecording &exc )
+			{
+				CI_LOG_E( exc.what() );
+				mRunning = false;
+				break;
+			}
+			mCameraQueues[ oldestCameraId ]->mFreeFrames.push( pendingFrames[ oldestCameraId ] );
+			pendingFrames[ oldestCameraId ] = kNone;
+		}
+		else
+		if ( ! running )
+		{
+			break;
+		}
+		else
+		{
+			ci::sleep( 1.0f );
+		}
+
+		mElapsedSeconds = std::chrono::duration< double >( std::chrono::steady_clock::now() - mStartTime ).count();
+	}
+}
+
+void DepthRecorder::writeFrame( size_t cameraId, size_t frameId )
+{
+	const Frame &frame = mCameraQueues[ cameraId ]->mFrames[ frameId ];
+	const uint64_t bytesWritten = mWriter->getNumBytesWritten();
+
+	if ( mCameraQueues[ cameraId ]->mDepth16 )
+	{
+		mWriter->addCompressedFrame( static_cast< uint32_t >( cameraId ), frame.mSequence, frame.mTimestamp, frame.mDepth );
+		mRawBytes += frame.mDepth.getWidth() * frame.mDepth.getHeight() * sizeof( uint16_t );
+	}
+	else
+	{
+		mWriter->addCompressedFrame( static_cast< uint32_t >( cameraId ), frame.mSequence, frame.mTimestamp, frame.mChannel );
+		mRawBytes += frame.mChannel.getWidth() * frame.mChannel.getHeight();
+	}
+
+	mNumFrames++;
+	mEncodedBytes += mWriter->getNumBytesWritten() - bytesWritten;
+}
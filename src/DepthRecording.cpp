@@ -0,0 +1,387 @@
+#include <algorithm>
+#include <cstring>
+
+#include "cinder/ip/Fill.h"
+
+#include "DepthRecording.h"
+
+using namespace ci;
+using namespace depthrecording;
+
+namespace {
+
+//! PackBits-codes the row deltas of \a channel, 16-bit deltas as their little-endian bytes.
+template< typename T >
+void encodeDeltaRleT( const ChannelT< T > &channel, std::vector< uint8_t > *output )
+{
+	const int32_t width = channel.getWidth();
+	const int32_t height = channel.getHeight();
+	const uint8_t increment = channel.getIncrement();
+	const size_t numBytes = size_t( width ) * height * sizeof( T );
+
+	// worst case is a control byte for every 128 literals
+	output->resize( numBytes + numBytes / 128 + 1 );
+	uint8_t *out = output->data();
+
+	size_t literalStart = 0; // position of the pending literal run's control byte
+	size_t numLiterals = 0;
+	size_t pos = 0;
+
+	auto flushLiterals = [ & ]()
+	{
+		if ( numLiterals )
+		{
+			out[ literalStart ] = uint8_t( numLiterals - 1 );
+			numLiterals = 0;
+		}
+	};
+
+	uint8_t runValue = 0;
+	size_t runLength = 0;
+
+	// runs shorter than 3 are cheaper as literals and keep the worst case bounded
+	auto flushRun = [ & ]()
+	{
+		if ( runLength >= 3 )
+		{
+			flushLiterals();
+			out[ pos++ ] = uint8_t( runLength + 126 );
+			out[ pos++ ] = runValue;
+		}
+		else
+		{
+			for ( size_t i = 0; i < runLength; i++ )
+			{
+				if ( numLiterals == 0 )
+				{
+					literalStart = pos++;
+				}
+				out[ pos++ ] = runValue;
+				if ( ++numLiterals == 128 )
+				{
+					flushLiterals();
+				}
+			}
+		}
+		runLength = 0;
+	};
+
+	auto addByte = [ & ]( uint8_t value )
+	{
+		if ( runLength && ( value == runValue ) && ( runLength < 129 ) )
+		{
+			runLength++;
+		}
+		else
+		{
+			flushRun();
+			runValue = value;
+			runLength = 1;
+		}
+	};
+
+	for ( int32_t y = 0; y < height; y++ )
+	{
+		const T *row = channel.getData( ivec2( 0, y ) );
+		T prev = 0;
+		for ( int32_t x = 0; x < width; x++ )
+		{
+			const T value = row[ x * increment ];
+			const T delta = T( value - prev );
+			prev = value;
+
+			for ( size_t i = 0; i < sizeof( T ); i++ )
+			{
+				addByte( uint8_t( delta >> ( 8 * i ) ) );
+			}
+		}
+	}
+	flushRun();
+	flushLiterals();
+
+	output->resize( pos );
+}
+
+template< typename T >
+bool decodeDeltaRleT( const uint8_t *data, size_t dataSize, int32_t width, int32_t height, T *output )
+{
+	const size_t numBytes = size_t( width ) * height * sizeof( T );
+	uint8_t *outputBytes = reinterpret_cast< uint8_t * >( output );
+	const uint8_t *end = data + dataSize;
+
+	// unpack the deltas
+	size_t pos = 0;
+	while ( ( data < end ) && ( pos < numBytes ) )
+	{
+		const uint8_t control = *data++;
+		if ( control < 128 )
+		{
+			const size_t count = control + 1;
+			if ( ( data + count > end ) || ( pos + count > numBytes ) )
+			{
+				return false;
+			}
+			std::memcpy( outputBytes + pos, data, count );
+			data += count;
+			pos += count;
+		}
+		else
+		{
+			const size_t count = control - 126;
+			if ( ( data >= end ) || ( pos + count > numBytes ) )
+			{
+				return false;
+			}
+			std::memset( outputBytes + pos, *data++, count );
+			pos += count;
+		}
+	}
+	if ( pos != numBytes )
+	{
+		return false;
+	}
+
+	// prefix sum per row, the recordings are written on little-endian hosts only
+	for ( int32_t y = 0; y < height; y++ )
+	{
+		T *row = output + size_t( y ) * width;
+		for ( int32_t x = 1; x < width; x++ )
+		{
+			row[ x ] = T( row[ x ] + row[ x - 1 ] );
+		}
+	}
+
+	return true;
+}
+
+} // anonymous namespace
+
+namespace depthrecording
+{
+
+void encodeDeltaRle( const Channel8u &channel, std::vector< uint8_t > *output )
+{
+	encodeDeltaRleT( channel, output );
+}
+
+void encodeDeltaRle( const Channel16u &channel, std::vector< uint8_t > *output )
+{
+	encodeDeltaRleT( channel, output );
+}
+
+bool decodeDeltaRle( const uint8_t *data, size_t dataSize, int32_t width, int32_t height, uint8_t *output )
+{
+	return decodeDeltaRleT( data, dataSize, width, height, output );
+}
+
+bool decodeDeltaRle( const uint8_t *data, size_t dataSize, int32_t width, int32_t height, uint16_t *output )
+{
+	return decodeDeltaRleT( data, dataSize, width, height, output );
+}
+
+void depthBandMask( const Channel16u &depth, uint16_t nearMm, uint16_t farMm, Channel8u *mask )
+{
+	const uint16_t low = std::max< uint16_t >( nearMm, 1 );
+	if ( farMm <= low )
+	{
+		// empty band
+		ip::fill( mask, uint8_t( 0 ) );
+		return;
+	}
+	const uint16_t range = farMm - low;
+	const int32_t width = depth.getWidth();
+
+	for ( int32_t y = 0; y < depth.getHeight(); y++ )
+	{
+		const uint16_t *src = depth.getData( ivec2( 0, y ) );
+		uint8_t *dst = mask->getData( ivec2( 0, y ) );
+		// a single unsigned comparison per pixel, which the compiler vectorizes
+		for ( int32_t x = 0; x < width; x++ )
+		{
+			dst[ x ] = ( uint16_t( src[ x ] - low ) <= range ) ? 255 : 0;
+		}
+	}
+}
+
+} // namespace depthrecording
+
+DepthRecordingWriter::DepthRecordingWriter( const fs::path &path, const std::vector< Camera > &cameras )
+{
+	mFile = fopen( path.string().c_str(), "wb" );
+	if ( ! mFile )
+	{
+		throw ExcDepthRecording( "Could not create " + path.string() );
+	}
+
+	for ( const auto &camera : cameras )
+	{
+		CameraInfo info;
+		std::memset( &info, 0, sizeof( info ) );
+		info.mWidth = camera.mSize.x;
+		info.mHeight = camera.mSize.y;
+		info.mBytesPerPixel = ( camera.mPixelFormat == PIXEL_FORMAT_DEPTH16 ) ? 2 : 1;
+		info.mPixelFormat = camera.mPixelFormat;
+		std::strncpy( info.mLabel, camera.mLabel.c_str(), sizeof( info.mLabel ) - 1 );
+		mCameras.push_back( info );
+	}
+
+	// the header is rewritten with the frame count and the index offset in finish()
+	FileHeader header;
+	std::memset( &header, 0, sizeof( header ) );
+	std::memcpy( header.mMagic, kMagic, sizeof( kMagic ) );
+	header.mVersion = kVersion;
+	header.mNumCameras = static_cast< uint32_t >( mCameras.size() );
+	write( &header, sizeof( header ) );
+	write( mCameras.data(), mCameras.size() * sizeof( CameraInfo ) );
+}
+
+DepthRecordingWriter::~DepthRecordingWriter()
+{
+	if ( mFile )
+	{
+		try
+		{
+			finish();
+		}
+		catch ( const ExcDepthRecording & )
+		{
+			fclose( mFile );
+		}
+	}
+}
+
+template< typename T >
+const CameraInfo & DepthRecordingWriter::checkFrame( uint32_t cameraId, const ChannelT< T > &channel ) const
+{
+	const CameraInfo &info = mCameras.at( cameraId );
+	if ( ( channel.getWidth() != info.mWidth ) || ( channel.getHeight() != info.mHeight ) )
+	{
+		throw ExcDepthRecording( "Frame size does not match camera " + std::string( info.mLabel ) );
+	}
+	if ( sizeof( T ) != info.mBytesPerPixel )
+	{
+		throw ExcDepthRecording( "Frame pixel format does not match camera " + std::string( info.mLabel ) );
+	}
+	return info;
+}
+
+template< typename T >
+void DepthRecordingWriter::addChannelFrame( uint32_t cameraId, uint64_t sequence, double timestamp, const ChannelT< T > &channel )
+{
+	const CameraInfo &info = checkFrame( cameraId, channel );
+
+	// tightly packed channels are written in one go, others row by row
+	const size_t rowSize = size_t( info.mWidth ) * sizeof( T );
+	const size_t dataSize = rowSize * info.mHeight;
+	if ( ( channel.getIncrement() == 1 ) && ( size_t( channel.getRowBytes() ) == rowSize ) )
+	{
+		addFrame( cameraId, sequence, timestamp, ENCODING_RAW, channel.getData(), dataSize );
+		return;
+	}
+
+	mRowBuffer.resize( dataSize );
+	for ( int32_t y = 0; y < info.mHeight; y++ )
+	{
+		const T *src = channel.getData( ivec2( 0, y ) );
+		T *dst = reinterpret_cast< T * >( &mRowBuffer[ y * rowSize ] );
+		for ( int32_t x = 0; x < info.mWidth; x++ )
+		{
+			dst[ x ] = src[ x * channel.getIncrement() ];
+		}
+	}
+	addFrame( cameraId, sequence, timestamp, ENCODING_RAW, mRowBuffer.data(), dataSize );
+}
+
+template< typename T >
+void DepthRecordingWriter::addCompressedChannelFrame( uint32_t cameraId, uint64_t sequence, double timestamp, const ChannelT< T > &channel )
+{
+	checkFrame( cameraId, channel );
+
+	encodeDeltaRle( channel, &mEncodeBuffer );
+	addFrame( cameraId, sequence, timestamp, ENCODING_DELTA_RLE, mEncodeBuffer.data(), mEncodeBuffer.size() );
+}
+
+void DepthRecordingWriter::addFrame( uint32_t cameraId, uint64_t sequence, double timestamp, const Channel8u &channel )
+{
+	addChannelFrame( cameraId, sequence, timestamp, channel );
+}
+
+void DepthRecordingWriter::addFrame( uint32_t cameraId, uint64_t sequence, double timestamp, const Channel16u &channel )
+{
+	addChannelFrame( cameraId, sequence, timestamp, channel );
+}
+
+void DepthRecordingWriter::addCompressedFrame( uint32_t cameraId, uint64_t sequence, double timestamp, const Channel8u &channel )
+{
+	addCompressedChannelFrame( cameraId, sequence, timestamp, channel );
+}
+
+void DepthRecordingWriter::addCompressedFrame( uint32_t cameraId, uint64_t sequence, double timestamp, const Channel16u &channel )
+{
+	addCompressedChannelFrame( cameraId, sequence, timestamp, channel );
+}
+
+void DepthRecordingWriter::addFrame( uint32_t cameraId, uint64_t sequence, double timestamp, Encoding encoding,
+									 const void *data, size_t dataSize )
+{
+	if ( ! mFile )
+	{
+		throw ExcDepthRecording( "Recording has already been finished" );
+	}
+
+	IndexEntry entry;
+	entry.mOffset = mOffset;
+	entry.mTimestamp = timestamp;
+	entry.mCameraId = cameraId;
+	entry.mReserved = 0;
+	mIndex.push_back( entry );
+
+	FrameHeader frameHeader;
+	frameHeader.mCameraId = cameraId;
+	frameHeader.mEncoding = encoding;
+	frameHeader.mSequence = sequence;
+	frameHeader.mTimestamp = timestamp;
+	frameHeader.mDataSize = dataSize;
+	write( &frameHeader, sizeof( frameHeader ) );
+	write( data, dataSize );
+
+	static const uint8_t padding[ 8 ] = { 0 };
+	write( padding, paddedSize( dataSize ) - dataSize );
+}
+
+void DepthRecordingWriter::finish()
+{
+	if ( ! mFile )
+	{
+		return;
+	}
+
+	FileHeader header;
+	std::memcpy( header.mMagic, kMagic, sizeof( kMagic ) );
+	header.mVersion = kVersion;
+	header.mNumCameras = static_cast< uint32_t >( mCameras.size() );
+	header.mNumFrames = mIndex.size();
+	header.mIndexOffset = mOffset;
+
+	// frames of different cameras might have been written slightly out of order
+	std::stable_sort( mIndex.begin(), mIndex.end(),
+			[]( const IndexEntry &e0, const IndexEntry &e1 )
+			{
+				return e0.mTimestamp < e1.mTimestamp;
+			} );
+
+	write( mIndex.data(), mIndex.size() * sizeof( IndexEntry ) );
+	fseek( mFile, 0, SEEK_SET );
+	fwrite( &header, sizeof( header ), 1, mFile );
+	fclose( mFile );
+	mFile = nullptr;
+}
+
+void DepthRecordingWriter::write( const void *data, size_t size )
+{
+	if ( size && ( fwrite( data, 1, size, mFile ) != size ) )
+	{
+		throw ExcDepthRecording( "Could not write recording" );
+	}
+	mOffset += size;
+}
@@ -1,8 +1,16 @@
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdlib>
+#include <functional>
+#include <mutex>
+#include <thread>
 #include <vector>
 
 #include "cinder/ImageIo.h"
 #include "cinder/Log.h"
 #include "cinder/Serial.h"
+#include "cinder/Utilities.h"
 #include "cinder/app/App.h"
 #include "cinder/app/RendererGl.h"
 #include "cinder/audio/Context.h"
@@ -10,18 +18,25 @@
 #include "cinder/ip/Fill.h"
 #include "cinder/ip/Resize.h"
 #include "cinder/params/Params.h"
+#if ! defined( CINDER_LINUX )
 #include "cinder/qtime/QuickTime.h"
+#endif
 
 #include "mndl/blobtracker/BlobTracker.h"
 #include "mndl/blobtracker/DebugDrawer.h"
 
+#include "BpmTimeline.h"
 #include "CellDetector.h"
 #include "ChannelView.h"
 #include "Config.h"
+#include "DepthPlayer.h"
 #include "GlobalData.h"
+#include "MosaicCompositor.h"
+#include "OfflineRenderer.h"
 #include "OniCameraManager.h"
 #include "ParamsUtils.h"
 #include "Sound.h"
+#include "SpscQueue.h"
 
 using namespace ci;
 using namespace ci::app;
@@ -60,14 +75,43 @@ class MetronomeApp : public App
 
 	Sound mSound;
 	bool mSoundEnabled;
+	int mSoundMode = static_cast< int >( MetronomeSynthNode::Mode::CLICKS );
+	int mSoundVoices;
+	bool mWindDownEnabled;
+	float mRunTime;
+	int mNumRunning = 0;
+	float mAudioLoad = 0.0f;
 	bool mDebugEnabled;
 
+	// bpm fields of the pipeline recorded for offline rendering, pipeline thread only
+	BpmTimeline mBpmTimeline;
+	bool mBpmTimelineRecording = false;
+	double mBpmTimelineStart = 0.0;
+	uint64_t mBpmTimelineGeneration = 0;
+	bool mRecordBpmTimeline = false; // params
+	void recordBpmTimeline();
+
+	int mRenderChannels;
+	float mRenderRealtimeFactor = 0.0f; // params, copied from mRenderedRealtimeFactor in update()
+	std::atomic< float > mRenderedRealtimeFactor { 0.0f };
+	std::atomic< bool > mRenderRunning { false };
+	std::shared_ptr< std::thread > mRenderThread;
+	//! Returns the render options of the sound params.
+	OfflineRenderer::Options getRenderOptions() const;
+	//! Renders the bpm timeline at \a timelinePath to \a wavPath through the synth used for playback.
+	//! Returns the realtime factor of the render or 0 if it failed.
+	double renderTimeline( const OfflineRenderer::Options &options, const fs::path &timelinePath, const fs::path &wavPath );
+	//! Renders on a worker thread, the realtime factor is published when the render is done.
+	void startRenderTimeline( const fs::path &timelinePath, const fs::path &wavPath );
+	//! Logs the render speed of generated timelines from 125 voices doubling up to \a maxVoices.
+	void benchmarkVoices( size_t maxVoices );
+
     Font				mFont;
     gl::TextureFontRef	mTextureFont;
     
     void displayCells();
-    void displaySerial();
-    void displayMetronomes( std::vector< int > rawResult, std::vector< int > bpmResult );
+    void displaySerial( const string &message );
+    void displayMetronomes( const ChannelView::Result &result );
     void sendSerial( string s );
     void sendSequencedSerial( vector< int > v );
     void sendMultiStringSerial( vector < string > multiString );
@@ -75,7 +119,11 @@ class MetronomeApp : public App
     void sendStopSerial();
     void sendOneSerial();
     void sendTwoSerials();
-    void sendIndexedSerials( int index, vector< int > bpmEven, vector< int > bpmOdd );
+    bool sendIndexedSerials( int index, const vector< int > &bpmEven, const vector< int > &bpmOdd );
+    void sendChangedIndexedSerials( int index, const vector< int > &bpmEven, const vector< int > &bpmOdd );
+    void forgetSentBpms();
+    vector< int > sentBpmEven; // values each device was last set to by the sweep, -1 if not known
+    vector< int > sentBpmOdd;
     void sendSync();
     void sendOneSync();
     void sendStartSerial();
@@ -102,26 +150,143 @@ class MetronomeApp : public App
 	ivec2 mTrackingResolution;
 	CameraData mCameraData[ kNumCameras ];
 
+	MosaicCompositorRef mMosaicCompositor;
+	std::vector< MosaicCompositor::Tile > mMosaicTiles;
+	std::vector< ChannelRef > mMosaicSources;
+
 	mndl::blobtracker::BlobTracker::Options mBlobTrackerOptions;
 	mndl::blobtracker::BlobTrackerRef mBlobTracker;
+	// the tracker only sees the part of the frame covering the grid area and the roi,
+	// its options are mBlobTrackerOptions remapped to the cropped area
+	mndl::blobtracker::BlobTracker::Options mCroppedTrackerOptions;
+	Area mTrackerCropArea;
+	Rectf mNormalizedTrackerCrop = Rectf( 0.0f, 0.0f, 1.0f, 1.0f );
+	//! Returns true if the crop area has changed, e.g. by editing the grid area.
+	bool updateTrackerCrop();
+	void updateCroppedTrackerOptions();
 	mndl::blobtracker::DebugDrawer::Options mDebugOptions;
 	ChannelRef mTrackerChannel;
+	// the tracker options of the params adjusted to the input, a depth band mask is tracked as it is
+	mndl::blobtracker::BlobTracker::Options mInputTrackerOptions;
+	bool mDepthBandInput = false;
+	void updateInputTrackerOptions( bool depthBand );
+
+	// generation counters of the pipeline stages, a stage only runs if its input has changed
+	std::atomic< bool > mTrackingChanged { true }; // source, arrangement or tracker parameters changed
+	std::vector< uint64_t > mCameraSequences;
+	uint64_t mTrackerGeneration = 0;
+	uint64_t mSoundGeneration = 0;
+	gl::Texture2dRef mTrackerTexture;
+	uint64_t mTrackerTextureGeneration = 0;
 
 	enum class TrackingSourceMode : int
 	{
 		CAMERA = 0,
 		IMAGE,
-		MOVIE
+		MOVIE,
+		RECORDING
 	};
 	TrackingSourceMode mTrackingSourceMode = TrackingSourceMode::CAMERA;
+#if ! defined( CINDER_LINUX )
 	qtime::MovieSurfaceRef mMovie;
-	ChannelRef mImage;
 	void loadMovie( const fs::path &moviePath );
+#endif
+	ChannelRef mImage;
+	// the still image resampled to the tracking resolution, only redone when the image or the resolution changes
+	Channel8u mResizedImage;
+	ChannelRef mResizedImageSource;
+	std::shared_ptr< std::thread > mImageLoadThread;
+	void loadImageSource( const fs::path &imagePath );
+
+	DepthPlayerRef mDepthPlayer;
+	bool mReplayRealtime = true;
+	std::atomic< float > mReplayPosition { 0.0f }; // of the pipeline thread, shown by the params from update()
+	float mReplayPositionParam = 0.0f;
+	float mReplaySeekPosition = 0.0f;
+	int mReplayDepthNear = 500; // depth band of 16-bit recordings in millimetres
+	int mReplayDepthFar = 4000;
+	void loadRecording( const fs::path &recordingPath );
 
 	void updateTracking();
-	void drawTracking();
+	CellDetector::DetectionMode mTrackedDetectionMode = CellDetector::DetectionMode::BLOB_CENTERS;
+	//! Returns the number of tracked blobs or occupied cells depending on the detection mode.
+	size_t getNumTracked() const;
+	void updateMosaicTiles( size_t numCameras );
 
 	CellDetectorRef mCellDetector;
+
+	// processing chain from the cameras to the serial port running on its own thread at a fixed rate
+	std::shared_ptr< std::thread > mPipelineThread;
+	std::atomic< bool > mPipelineRunning { false };
+	float mPipelineRate;
+	float mPipelineFps = 0.0f;
+	void pipelineThreadFn();
+	void updatePipeline();
+
+	//! Runs \a fn on the pipeline thread before its next update.
+	void runOnPipelineThread( const std::function< void () > &fn );
+	std::mutex mPipelineCommandsMutex;
+	std::vector< std::function< void () > > mPipelineCommands;
+	std::vector< std::function< void () > > mPipelineCommandsToRun;
+
+	//! Values of the params read by the pipeline thread. The params edit the members on the ui thread,
+	//! update() commits a copy and the pipeline thread takes it over at the start of its update.
+	struct PipelineSettings
+	{
+		TrackingSourceMode mTrackingSourceMode = TrackingSourceMode::CAMERA;
+		ivec2 mTrackingResolution;
+		CameraData mCameraData[ kNumCameras ];
+		mndl::blobtracker::BlobTracker::Options mBlobTrackerOptions;
+		bool mReplayRealtime = true;
+		int mReplayDepthNear = 500;
+		int mReplayDepthFar = 4000;
+		float mPipelineRate = 60.0f;
+		bool mSoundEnabled = false;
+	};
+	PipelineSettings mPipelineSettings; // pipeline thread only
+	PipelineSettings mPendingPipelineSettings; // guarded by mPipelineSettingsMutex
+	bool mPendingTrackingChanged = false; // guarded by mPipelineSettingsMutex
+	bool mTrackingParamsChanged = false; // set by the tracking params on the ui thread
+	std::mutex mPipelineSettingsMutex;
+	void commitPipelineSettings();
+	void applyPipelineSettings();
+
+	//! Results of a pipeline update, immutable once published. draw() only reads these.
+	struct PipelineSnapshot
+	{
+		Channel8u mTrackerChannel;
+		uint64_t mTrackerGeneration = 0;
+		Area mTrackerCropArea;
+		mndl::blobtracker::BlobTracker::Options mTrackerOptions;
+		//! Labels of the cameras composited into the tracker channel at the upper left of their tiles.
+		struct CameraLabel
+		{
+			std::string mText;
+			ivec2 mPos;
+		};
+		std::vector< CameraLabel > mCameraLabels;
+		size_t mNumCameraLabels = 0;
+		ChannelView::ResultRef mChannelViewResult;
+		std::string mSerialMessage;
+	};
+	// Snapshots are handed over explicitly. The pipeline fills free snapshots and publishes them in
+	// mReadySnapshots, draw() keeps the freshest one and returns the rest in mFreeSnapshots.
+	static const size_t kNumPipelineSnapshots = 3;
+	PipelineSnapshot mPipelineSnapshots[ kNumPipelineSnapshots ];
+	mndl::SpscQueue< size_t > mReadySnapshots { kNumPipelineSnapshots };
+	mndl::SpscQueue< size_t > mFreeSnapshots { kNumPipelineSnapshots };
+	size_t mDrawnSnapshotId = kNumPipelineSnapshots; // held by draw(), kNumPipelineSnapshots if none
+	void publishSnapshot();
+
+	// the debug drawer reads the tracker's internal images, draw() tracks the snapshot's input
+	// with its own tracker, so the pipeline tracker is never shared with the gl thread
+	mndl::blobtracker::BlobTrackerRef mDebugBlobTracker;
+	mndl::blobtracker::BlobTracker::Options mDebugTrackerOptions;
+	Channel8u mDebugTrackerInput;
+	Area mDebugTrackerCropArea = Area( 0, 0, 0, 0 ); // of mDebugTrackerInput in the tracker channel
+	uint64_t mDebugTrackerGeneration = 0;
+
+	void drawTracking( const PipelineSnapshot &snapshot );
 };
 
 // static
@@ -132,16 +297,20 @@ void MetronomeApp::prepareSettings( Settings *settings )
 
 void MetronomeApp::setup()
 {
-    disableFrameRate();
+    // the pipeline runs on its own thread, drawing faster than the display only burns cpu
+    setFrameRate( 60.0f );
     gl::enableVerticalSync( false );
     
 	GlobalData &gd = GlobalData::get();
 	gd.mConfig = mndl::Config::create();
 
-	mBlobTracker = mndl::blobtracker::BlobTracker::create( mBlobTrackerOptions );
+	mBlobTracker = mndl::blobtracker::BlobTracker::create( mCroppedTrackerOptions );
+	mDebugBlobTracker = mndl::blobtracker::BlobTracker::create( mDebugTrackerOptions );
 
 	mCellDetector = CellDetector::create();
 
+	mMosaicCompositor = MosaicCompositor::create();
+
 	setupParams();
 	setupParamsTracking();
 
@@ -156,9 +325,31 @@ void MetronomeApp::setup()
 
 	readConfig();
 	mndl::params::showAllParams( true );
+
+	// --render <timeline> <wav> renders offline without starting the cameras or the audio output
+	const auto &args = getCommandLineArgs();
+	auto renderArg = std::find( args.begin(), args.end(), "--render" );
+	if ( ( renderArg != args.end() ) && ( args.end() - renderArg >= 3 ) )
+	{
+		renderTimeline( getRenderOptions(), *( renderArg + 1 ), *( renderArg + 2 ) );
+		quit();
+		return;
+	}
+	// --benchmark [max voices] measures how many voices render in realtime
+	auto benchmarkArg = std::find( args.begin(), args.end(), "--benchmark" );
+	if ( benchmarkArg != args.end() )
+	{
+		size_t maxVoices = ( args.end() - benchmarkArg >= 2 ) ? std::strtoul( ( benchmarkArg + 1 )->c_str(), nullptr, 10 ) : 0;
+		benchmarkVoices( maxVoices ? maxVoices : 16000 );
+		quit();
+		return;
+	}
     
     auto ctx = audio::master();
-    mSound.setup(*ctx);
+    mSound.setup( *ctx, mSoundVoices );
+	mSound.mSynth->setMode( static_cast< MetronomeSynthNode::Mode >( mSoundMode ) );
+	mSound.mSynth->setRunTime( mRunTime );
+	mSound.mSynth->setWindDownEnabled( mWindDownEnabled );
 
 	if ( mSoundEnabled )
 	{
@@ -166,6 +357,11 @@ void MetronomeApp::setup()
 	}
 
 	mOniCameraManager->startup();
+
+	for ( size_t i = 0; i < kNumPipelineSnapshots; i++ )
+	{
+		mFreeSnapshots.push( i );
+	}
     
     serialIndex = 0;
     resetTimeOut = 0;
@@ -208,6 +404,10 @@ void MetronomeApp::setup()
                                 3,  8, 13, 18, 23, 28, 33, 38, 43, 48,
                                 4,  9, 14, 19, 24, 29, 34, 39, 44, 49,
                                 5, 10, 15, 20, 25, 30, 35, 40, 45, 50 };
+
+	commitPipelineSettings();
+	mPipelineRunning = true;
+	mPipelineThread = std::make_shared< std::thread >( std::bind( &MetronomeApp::pipelineThreadFn, this ) );
 }
 
 void MetronomeApp::setupParams()
@@ -216,6 +416,8 @@ void MetronomeApp::setupParams()
 
 	mParams = params::InterfaceGl::create( "Parameters", ivec2( 200, 300 ) );
 	mParams->addParam( "Fps", &mFps, true );
+	mParams->addParam( "Pipeline rate", &mPipelineRate ).min( 1.0f ).max( 240.0f ).step( 1.0f );
+	mParams->addParam( "Pipeline fps", &mPipelineFps, true );
 	mParams->addSeparator();
 
 	mParams->addText( "Metronome grid" );
@@ -228,11 +430,101 @@ void MetronomeApp::setupParams()
 			{
 				audio::master()->setEnabled( mSoundEnabled );
 			} );
+	mParams->addParam( "Sound mode", { "filtered phasors", "clicks" }, &mSoundMode ).updateFn(
+			[ this ]()
+			{
+				mSound.mSynth->setMode( static_cast< MetronomeSynthNode::Mode >( mSoundMode ) );
+			} );
+	// takes effect at the next start, 0 is one voice per grid cell
+	mParams->addParam( "Sound voices", &mSoundVoices ).min( 0 ).max( 65536 );
+	mParams->addParam( "Wind-down", &mWindDownEnabled ).updateFn(
+			[ this ]()
+			{
+				mSound.mSynth->setWindDownEnabled( mWindDownEnabled );
+			} );
+	mParams->addParam( "Run time", &mRunTime ).min( 1.0f ).step( 10.0f ).updateFn(
+			[ this ]()
+			{
+				mSound.mSynth->setRunTime( mRunTime );
+			} );
+	mParams->addButton( "Wind metronomes", [ this ]()
+			{
+				mSound.mSynth->wind();
+			} );
+	mParams->addParam( "Running metronomes", &mNumRunning, true );
+	mParams->addParam( "Audio load", &mAudioLoad, true );
 	mParams->addParam( "Debug enable", &mDebugEnabled );
+	mParams->addSeparator();
+
+	mParams->addText( "Offline render" );
+	mParams->addParam( "Record bpm timeline", &mRecordBpmTimeline ).updateFn(
+			[ this ]()
+			{
+				bool record = mRecordBpmTimeline;
+				runOnPipelineThread( [ this, record ]()
+						{
+							mBpmTimelineRecording = record;
+							if ( record )
+							{
+								mBpmTimeline.clear();
+								mBpmTimelineStart = getElapsedSeconds();
+								recordBpmTimeline();
+							}
+						} );
+			} );
+	mParams->addButton( "Save bpm timeline", [ this ]()
+			{
+				fs::path appPath = app::getAppPath();
+#ifdef CINDER_MAC
+				appPath = appPath.parent_path();
+#endif
+				fs::path savePath = app::getSaveFilePath( appPath, { "txt" } );
+				if ( savePath.empty() )
+				{
+					return;
+				}
+				runOnPipelineThread( [ this, savePath ]()
+						{
+							try
+							{
+								mBpmTimeline.write( savePath );
+								CI_LOG_I( "Saved " << mBpmTimeline.getFields().size() << " bpm fields to " << savePath.string() );
+							}
+							catch ( const ExcBpmTimeline &exc )
+							{
+								CI_LOG_E( exc.what() );
+							}
+						} );
+			} );
+	mParams->addButton( "Render timeline", [ this ]()
+			{
+				fs::path appPath = app::getAppPath();
+#ifdef CINDER_MAC
+				appPath = appPath.parent_path();
+#endif
+				fs::path timelinePath = app::getOpenFilePath( appPath, { "txt" } );
+				if ( timelinePath.empty() )
+				{
+					return;
+				}
+				fs::path wavPath = app::getSaveFilePath( appPath, { "wav" } );
+				if ( ! wavPath.empty() )
+				{
+					startRenderTimeline( timelinePath, wavPath );
+				}
+			} );
+	mParams->addParam( "Render channels", &mRenderChannels ).min( 1 ).max( 64 );
+	mParams->addParam( "Render realtime factor", &mRenderRealtimeFactor, true );
 
 	gd.mConfig->addVar( "Sound.Enable", &mSoundEnabled, false );
+	gd.mConfig->addVar( "Sound.Mode", &mSoundMode, static_cast< int >( MetronomeSynthNode::Mode::CLICKS ) );
+	gd.mConfig->addVar( "Sound.NumVoices", &mSoundVoices, 0 );
+	gd.mConfig->addVar( "Sound.WindDown", &mWindDownEnabled, false );
+	gd.mConfig->addVar( "Sound.RunTime", &mRunTime, 300.0f );
 	gd.mConfig->addVar( "Debug.Enable", &mDebugEnabled, false );
+	gd.mConfig->addVar( "Render.Channels", &mRenderChannels, 2 );
 	gd.mConfig->addVar( "GridSize", &gd.mGridSize, 9 );
+	gd.mConfig->addVar( "Pipeline.Rate", &mPipelineRate, 60.0f );
 }
 
 void MetronomeApp::setupParamsTracking()
@@ -241,26 +533,29 @@ void MetronomeApp::setupParamsTracking()
 	mParamsTracking = params::InterfaceGl::create( "Tracking", ivec2( 200, 300 ) );
 	mParamsTracking->setPosition( ivec2( 548, 16 ) );
 
+	// the pipeline retracks once it has taken over the edited values, see commitPipelineSettings()
+	auto trackingChanged = [ this ]() { mTrackingParamsChanged = true; };
+
 	mParamsTracking->addText( "Source" );
-	mParamsTracking->addParam( "Input source", { "camera", "image", "movie" },
-								reinterpret_cast< int * >( &mTrackingSourceMode ) );
+	mParamsTracking->addParam( "Input source", { "camera", "image", "movie", "recording" },
+								reinterpret_cast< int * >( &mTrackingSourceMode ) ).updateFn( trackingChanged );
 	mParamsTracking->addButton( "Load image", [ & ]()
 			{
 				fs::path imagePath = app::getOpenFilePath();
 				if ( fs::exists( imagePath ) )
 				{
-					try
-					{
-						mImage = Channel::create( loadImage( imagePath ) );
-					}
-					catch ( const ImageIoExceptionFailedLoad & )
-					{ }
+					loadImageSource( imagePath );
 				}
 				else
 				{
-					mImage.reset();
+					runOnPipelineThread( [ this ]()
+							{
+								mImage.reset();
+								mTrackingChanged = true;
+							} );
 				}
 			} );
+#if ! defined( CINDER_LINUX )
 	mParamsTracking->addButton( "Load movie", [ & ]()
 			{
 				fs::path moviePath = app::getOpenFilePath();
@@ -270,17 +565,48 @@ void MetronomeApp::setupParamsTracking()
 				}
 				else
 				{
-					mMovie.reset();
+					runOnPipelineThread( [ this ]() { mMovie.reset(); } );
+				}
+			} );
+#endif
+	mParamsTracking->addButton( "Load recording", [ & ]()
+			{
+				fs::path recordingPath = app::getOpenFilePath();
+				if ( fs::exists( recordingPath ) )
+				{
+					loadRecording( recordingPath );
+				}
+				else
+				{
+					runOnPipelineThread( [ this ]() { mDepthPlayer.reset(); } );
 				}
 			} );
+	mParamsTracking->addParam( "Replay realtime", &mReplayRealtime );
+	mParamsTracking->addParam( "Replay position", &mReplayPositionParam, true );
+	mParamsTracking->addParam( "Seek position", &mReplaySeekPosition ).min( 0.0f ).step( 1.0f );
+	mParamsTracking->addParam( "Replay near (mm)", &mReplayDepthNear ).min( 0 ).max( 10000 ).step( 10 );
+	mParamsTracking->addParam( "Replay far (mm)", &mReplayDepthFar ).min( 0 ).max( 10000 ).step( 10 );
+	mParamsTracking->addButton( "Seek",
+			[ this ]()
+			{
+				float position = mReplaySeekPosition;
+				runOnPipelineThread( [ this, position ]()
+						{
+							if ( mDepthPlayer )
+							{
+								mDepthPlayer->seek( position );
+								mTrackingChanged = true;
+							}
+						} );
+			} );
 	mParamsTracking->addSeparator();
 
 	mParamsTracking->addText( "Arrangement" );
 	const std::string resolutionGroup = "Resolution";
 	mParamsTracking->addParam( "Resolution X", &mTrackingResolution.x ).min( 320 ).group( resolutionGroup ).
-		updateFn( [ this ]() { mTrackerChannel.reset(); } );
+		updateFn( trackingChanged );
 	mParamsTracking->addParam( "Resolution Y", &mTrackingResolution.y ).min( 240 ).group( resolutionGroup ).
-		updateFn( [ this ]() { mTrackerChannel.reset(); } );
+		updateFn( trackingChanged );
 	mParamsTracking->setOptions( resolutionGroup, " opened=false " );
 	gd.mConfig->addVar( "Tracking.Resolution", &mTrackingResolution, ivec2( 640, 480 ) );
 
@@ -288,13 +614,13 @@ void MetronomeApp::setupParamsTracking()
 	{
 		std::string groupName = "Camera #" + toString( i );
 		std::string areaGroup = groupName + " area #" + toString( i );
-		mParamsTracking->addParam( groupName + " X1", &mCameraData[ i ].mSrcArea.x1 ).min( 0 ).group( areaGroup );
-		mParamsTracking->addParam( groupName + " Y1", &mCameraData[ i ].mSrcArea.y1 ).min( 0 ).group( areaGroup );
-		mParamsTracking->addParam( groupName + " X2", &mCameraData[ i ].mSrcArea.x2 ).min( 0 ).group( areaGroup );
-		mParamsTracking->addParam( groupName + " Y2", &mCameraData[ i ].mSrcArea.y2 ).min( 0 ).group( areaGroup );
+		mParamsTracking->addParam( groupName + " X1", &mCameraData[ i ].mSrcArea.x1 ).min( 0 ).group( areaGroup ).updateFn( trackingChanged );
+		mParamsTracking->addParam( groupName + " Y1", &mCameraData[ i ].mSrcArea.y1 ).min( 0 ).group( areaGroup ).updateFn( trackingChanged );
+		mParamsTracking->addParam( groupName + " X2", &mCameraData[ i ].mSrcArea.x2 ).min( 0 ).group( areaGroup ).updateFn( trackingChanged );
+		mParamsTracking->addParam( groupName + " Y2", &mCameraData[ i ].mSrcArea.y2 ).min( 0 ).group( areaGroup ).updateFn( trackingChanged );
 		std::string offsetGroup = groupName + " offset #" + toString( i );
-		mParamsTracking->addParam( groupName + " offset X", &mCameraData[ i ].mOffset.x ).min( 0 ).group( offsetGroup );
-		mParamsTracking->addParam( groupName + " offset Y", &mCameraData[ i ].mOffset.y ).min( 0 ).group( offsetGroup );
+		mParamsTracking->addParam( groupName + " offset X", &mCameraData[ i ].mOffset.x ).min( 0 ).group( offsetGroup ).updateFn( trackingChanged );
+		mParamsTracking->addParam( groupName + " offset Y", &mCameraData[ i ].mOffset.y ).min( 0 ).group( offsetGroup ).updateFn( trackingChanged );
 		mParamsTracking->setOptions( areaGroup, "group='" + groupName + "'" + " opened=false " );
 		mParamsTracking->setOptions( offsetGroup, "group='" + groupName + "'" + " opened=false " );
 		mParamsTracking->setOptions( groupName, " opened=false " );
@@ -311,23 +637,23 @@ void MetronomeApp::setupParamsTracking()
 	mParamsTracking->addSeparator();
 
 	mParamsTracking->addText( "Blob tracker" );
-	mParamsTracking->addParam( "Flip", &mBlobTrackerOptions.mFlip );
-	mParamsTracking->addParam( "Threshold", &mBlobTrackerOptions.mThreshold ).min( 0 ).max( 255 );
-	mParamsTracking->addParam( "Threshold inverts", &mBlobTrackerOptions.mThresholdInvertEnabled );
-	mParamsTracking->addParam( "Blur size", &mBlobTrackerOptions.mBlurSize ).min( 1 ).max( 15 );
-	mParamsTracking->addParam( "Min area", &mBlobTrackerOptions.mMinArea ).min( 0.0f ).max( 1.0f ).step( 0.0001f );
-	mParamsTracking->addParam( "Max area", &mBlobTrackerOptions.mMaxArea ).min( 0.0f ).max( 1.0f ).step( 0.001f );
-	mParamsTracking->addParam( "Bounds", &mBlobTrackerOptions.mBoundsEnabled );
+	mParamsTracking->addParam( "Flip", &mBlobTrackerOptions.mFlip ).updateFn( trackingChanged );
+	mParamsTracking->addParam( "Threshold", &mBlobTrackerOptions.mThreshold ).min( 0 ).max( 255 ).updateFn( trackingChanged );
+	mParamsTracking->addParam( "Threshold inverts", &mBlobTrackerOptions.mThresholdInvertEnabled ).updateFn( trackingChanged );
+	mParamsTracking->addParam( "Blur size", &mBlobTrackerOptions.mBlurSize ).min( 1 ).max( 15 ).updateFn( trackingChanged );
+	mParamsTracking->addParam( "Min area", &mBlobTrackerOptions.mMinArea ).min( 0.0f ).max( 1.0f ).step( 0.0001f ).updateFn( trackingChanged );
+	mParamsTracking->addParam( "Max area", &mBlobTrackerOptions.mMaxArea ).min( 0.0f ).max( 1.0f ).step( 0.001f ).updateFn( trackingChanged );
+	mParamsTracking->addParam( "Bounds", &mBlobTrackerOptions.mBoundsEnabled ).updateFn( trackingChanged );
 	mParamsTracking->addParam( "Top left x", &mBlobTrackerOptions.mNormalizedRegionOfInterest.x1 )
-		.min( 0.f ).max( 1.f ).step( 0.001f ).group( "Region of Interest" );
+		.min( 0.f ).max( 1.f ).step( 0.001f ).group( "Region of Interest" ).updateFn( trackingChanged );
 	mParamsTracking->addParam( "Top left y", &mBlobTrackerOptions.mNormalizedRegionOfInterest.y1 )
-		.min( 0.f ).max( 1.f ).step( 0.001f ).group( "Region of Interest" );
+		.min( 0.f ).max( 1.f ).step( 0.001f ).group( "Region of Interest" ).updateFn( trackingChanged );
 	mParamsTracking->addParam( "Bottom right x", &mBlobTrackerOptions.mNormalizedRegionOfInterest.x2 )
-		.min( 0.f ).max( 1.f ).step( 0.001f ).group( "Region of Interest" );
+		.min( 0.f ).max( 1.f ).step( 0.001f ).group( "Region of Interest" ).updateFn( trackingChanged );
 	mParamsTracking->addParam( "Bottom right y", &mBlobTrackerOptions.mNormalizedRegionOfInterest.y2 )
-		.min( 0.f ).max( 1.f ).step( 0.001f ).group( "Region of Interest" );
+		.min( 0.f ).max( 1.f ).step( 0.001f ).group( "Region of Interest" ).updateFn( trackingChanged );
 	mParamsTracking->addParam( "Blank outside Roi", &mBlobTrackerOptions.mBlankOutsideRoi )
-		.group( "Region of Interest" );
+		.group( "Region of Interest" ).updateFn( trackingChanged );
 	mParamsTracking->setOptions( "Region of Interest", "opened=false" );
 	mParamsTracking->addSeparator();
 
@@ -377,11 +703,113 @@ void MetronomeApp::setupSerial()
     if( mSerial ) {
         mSerial->flush();
     }
+    forgetSentBpms();
 }
 
 void MetronomeApp::update()
 {
 	mFps = getAverageFps();
+	mReplayPositionParam = mReplayPosition;
+	mRenderRealtimeFactor = mRenderedRealtimeFactor;
+
+	// the pipeline thread picks up the edited params at its next update
+	commitPipelineSettings();
+	mCellDetector->commitParams();
+	mChannelView.commitParams();
+
+	// not set up if the app only rendered from the command line
+	if ( mSound.mSynth )
+	{
+		mAudioLoad = mSound.mSynth->getLoad();
+		mNumRunning = int( mSound.mSynth->getNumRunning() );
+	}
+}
+
+void MetronomeApp::pipelineThreadFn()
+{
+	double nextUpdateTime = getElapsedSeconds();
+	double lastUpdateTime = nextUpdateTime;
+	while ( mPipelineRunning )
+	{
+		updatePipeline();
+
+		double now = getElapsedSeconds();
+		static const double kFpsSmoothing = 0.95;
+		mPipelineFps = float( kFpsSmoothing * mPipelineFps + ( 1.0 - kFpsSmoothing ) / math< double >::max( now - lastUpdateTime, 1e-6 ) );
+		lastUpdateTime = now;
+
+		// non-realtime replay runs as fast as possible for benchmarking
+		if ( ( mPipelineSettings.mTrackingSourceMode == TrackingSourceMode::RECORDING ) &&
+			 ! mPipelineSettings.mReplayRealtime )
+		{
+			nextUpdateTime = now;
+			continue;
+		}
+
+		nextUpdateTime += 1.0 / math< float >::max( mPipelineSettings.mPipelineRate, 1.0f );
+		if ( nextUpdateTime > now )
+		{
+			ci::sleep( float( ( nextUpdateTime - now ) * 1000.0 ) );
+		}
+		else
+		{
+			// running late, do not try to catch up
+			nextUpdateTime = now;
+		}
+	}
+}
+
+void MetronomeApp::runOnPipelineThread( const std::function< void () > &fn )
+{
+	std::lock_guard< std::mutex > lock( mPipelineCommandsMutex );
+	mPipelineCommands.push_back( fn );
+}
+
+void MetronomeApp::commitPipelineSettings()
+{
+	std::lock_guard< std::mutex > lock( mPipelineSettingsMutex );
+	PipelineSettings &settings = mPendingPipelineSettings;
+	settings.mTrackingSourceMode = mTrackingSourceMode;
+	settings.mTrackingResolution = mTrackingResolution;
+	std::copy( mCameraData, mCameraData + kNumCameras, settings.mCameraData );
+	settings.mBlobTrackerOptions = mBlobTrackerOptions;
+	settings.mReplayRealtime = mReplayRealtime;
+	settings.mReplayDepthNear = mReplayDepthNear;
+	settings.mReplayDepthFar = mReplayDepthFar;
+	settings.mPipelineRate = mPipelineRate;
+	settings.mSoundEnabled = mSoundEnabled;
+	// the change is only signalled together with the values it was made to
+	mPendingTrackingChanged = mPendingTrackingChanged || mTrackingParamsChanged;
+	mTrackingParamsChanged = false;
+}
+
+void MetronomeApp::applyPipelineSettings()
+{
+	std::lock_guard< std::mutex > lock( mPipelineSettingsMutex );
+	mPipelineSettings = mPendingPipelineSettings;
+	if ( mPendingTrackingChanged )
+	{
+		mTrackingChanged = true;
+		mPendingTrackingChanged = false;
+	}
+}
+
+void MetronomeApp::updatePipeline()
+{
+	applyPipelineSettings();
+
+	{
+		std::lock_guard< std::mutex > lock( mPipelineCommandsMutex );
+		std::swap( mPipelineCommands, mPipelineCommandsToRun );
+	}
+	for ( const auto &fn : mPipelineCommandsToRun )
+	{
+		fn();
+	}
+	mPipelineCommandsToRun.clear();
+
+	mCellDetector->applyParams();
+	mChannelView.applyParams();
 
 	mOniCameraManager->update();
 
@@ -389,10 +817,15 @@ void MetronomeApp::update()
 
 	const auto &blobCenters = mCellDetector->getBlobCellCoords();
 
-    mChannelView.update( blobCenters );
-	if ( mSoundEnabled )
+    mChannelView.update( blobCenters, mCellDetector->getGeneration(), mCellDetector->getOccupancy() );
+	if ( mBpmTimelineRecording && ( mBpmTimelineGeneration != mChannelView.getGeneration() ) )
+	{
+		recordBpmTimeline();
+	}
+	if ( mPipelineSettings.mSoundEnabled && ( mSoundGeneration != mChannelView.getGeneration() ) )
 	{
 		mSound.update( mChannelView.getBpmResultAsVector() );
+		mSoundGeneration = mChannelView.getGeneration();
 	}
     
     //  Orginial concept of sending data not working with strings on the Fablab guys side,
@@ -400,9 +833,9 @@ void MetronomeApp::update()
     
     if( canSendIndexed ) { // fill all devices with values
         if( rotateMetronomeMatrix ) { // Fablab Guys connected devices in wrong order, we have to rotate the plane, 90 degrees CCW
-            sendIndexedSerials( rotatedMetronomeIndexes[ serialIndex ] - 1, mChannelView.getBpmResultAsVectorEven(), mChannelView.getBpmResultAsVectorOdd() ); //   iterate over devices frame by frame
+            sendChangedIndexedSerials( rotatedMetronomeIndexes[ serialIndex ] - 1, mChannelView.getBpmResultAsVectorEven(), mChannelView.getBpmResultAsVectorOdd() ); //   iterate over devices frame by frame
         }else{
-            sendIndexedSerials( serialIndex,  mChannelView.getBpmResultAsVectorEven(), mChannelView.getBpmResultAsVectorOdd() ); //   iterate over devices frame by frame
+            sendChangedIndexedSerials( serialIndex,  mChannelView.getBpmResultAsVectorEven(), mChannelView.getBpmResultAsVectorOdd() ); //   iterate over devices frame by frame
         }
         serialIndex ++;
     }
@@ -411,7 +844,7 @@ void MetronomeApp::update()
         sendSync();
         serialIndex++;
     }else if( serialIndex == 50 ){
-        if( mBlobTracker->getNumBlobs() == 0 )  {
+        if( getNumTracked() == 0 )  {
             if(canReset) {
                 if( resetTimeOut > 3 ) {
                     sendResetSerial();
@@ -419,7 +852,7 @@ void MetronomeApp::update()
                 }
             }
             resetTimeOut++;
-        }else if(mBlobTracker->getNumBlobs() > 0) {
+        }else if( getNumTracked() > 0 ) {
             canReset = true;
             resetTimeOut = 0;
         }
@@ -428,48 +861,367 @@ void MetronomeApp::update()
         serialIndex = 0;
         canSendIndexed = true;
     }
+
+	publishSnapshot();
 }
 
-void MetronomeApp::updateTracking()
+void MetronomeApp::recordBpmTimeline()
+{
+	mBpmTimeline.addField( getElapsedSeconds() - mBpmTimelineStart, mChannelView.getBpmResultAsVector() );
+	mBpmTimelineGeneration = mChannelView.getGeneration();
+}
+
+OfflineRenderer::Options MetronomeApp::getRenderOptions() const
 {
-	if ( ! mTrackerChannel )
+	OfflineRenderer::Options options;
+	options.mNumChannels = size_t( math< int >::max( mRenderChannels, 1 ) );
+	options.mMode = static_cast< MetronomeSynth::Mode >( mSoundMode );
+	options.mWindDown = mWindDownEnabled;
+	options.mRunTime = mRunTime;
+	return options;
+}
+
+double MetronomeApp::renderTimeline( const OfflineRenderer::Options &options, const fs::path &timelinePath,
+									 const fs::path &wavPath )
+{
+	OfflineRenderer renderer( options );
+
+	try
+	{
+		BpmTimeline timeline = BpmTimeline::read( timelinePath );
+		OfflineRenderer::Stats stats = renderer.render( timeline, wavPath );
+		CI_LOG_I( "Rendered " << timeline.getNumVoices() << " voices, " << stats.mRenderedSeconds << "s in " <<
+				  stats.mElapsedSeconds << "s, " << stats.getRealtimeFactor() << "x realtime to " << wavPath.string() );
+		return stats.getRealtimeFactor();
+	}
+	catch ( const ExcBpmTimeline &exc )
+	{
+		CI_LOG_E( exc.what() );
+	}
+	catch ( const ExcOfflineRender &exc )
+	{
+		CI_LOG_E( exc.what() );
+	}
+	return 0.0;
+}
+
+void MetronomeApp::startRenderTimeline( const fs::path &timelinePath, const fs::path &wavPath )
+{
+	if ( mRenderRunning )
+	{
+		CI_LOG_W( "Still rendering the previous timeline" );
+		return;
+	}
+	if ( mRenderThread )
+	{
+		mRenderThread->join();
+	}
+
+	// long timelines would block the ui, the options are taken from the params before the render starts
+	const OfflineRenderer::Options options = getRenderOptions();
+	mRenderRunning = true;
+	mRenderThread =
+		std::shared_ptr< std::thread >( new std::thread( [ this, options, timelinePath, wavPath ]()
+			{
+				mRenderedRealtimeFactor = float( renderTimeline( options, timelinePath, wavPath ) );
+				mRenderRunning = false;
+			} ) );
+}
+
+void MetronomeApp::benchmarkVoices( size_t maxVoices )
+{
+	OfflineRenderer::Options options;
+	options.mNumChannels = 1;
+	options.mMode = static_cast< MetronomeSynth::Mode >( mSoundMode );
+	options.mWindDown = mWindDownEnabled;
+	options.mRunTime = mRunTime;
+
+	for ( size_t numVoices = 125; numVoices <= maxVoices; numVoices *= 2 )
+	{
+		BpmTimeline timeline = BpmTimeline::generate( numVoices, 10.0 );
+		OfflineRenderer::Stats stats = OfflineRenderer( options ).render( timeline, fs::path() );
+		// the render time grows linearly with the number of voices
+		CI_LOG_I( numVoices << " voices: " << stats.getRealtimeFactor() << "x realtime, about " <<
+				  size_t( numVoices * stats.getRealtimeFactor() ) << " voices fit in realtime" );
+	}
+}
+
+void MetronomeApp::publishSnapshot()
+{
+	size_t snapshotId;
+	if ( ! mFreeSnapshots.pop( &snapshotId ) )
+	{
+		// draw() has not caught up yet
+		return;
+	}
+	PipelineSnapshot *snapshot = &mPipelineSnapshots[ snapshotId ];
+
+	if ( ( snapshot->mTrackerGeneration != mTrackerGeneration ) ||
+		 ( snapshot->mTrackerChannel.getSize() != mTrackerChannel->getSize() ) )
+	{
+		if ( snapshot->mTrackerChannel.getSize() != mTrackerChannel->getSize() )
+		{
+			snapshot->mTrackerChannel = Channel8u( mTrackerChannel->getWidth(), mTrackerChannel->getHeight() );
+		}
+		snapshot->mTrackerChannel.copyFrom( *mTrackerChannel, mTrackerChannel->getBounds() );
+		snapshot->mTrackerGeneration = mTrackerGeneration;
+		snapshot->mTrackerCropArea = mTrackerCropArea;
+		snapshot->mTrackerOptions = mCroppedTrackerOptions;
+	}
+
+	// the labels follow the tiles the tracker channel was composited with
+	const TrackingSourceMode sourceMode = mPipelineSettings.mTrackingSourceMode;
+	const bool recording = ( sourceMode == TrackingSourceMode::RECORDING ) && mDepthPlayer;
+	size_t numLabels = 0;
+	if ( ( sourceMode == TrackingSourceMode::CAMERA ) || recording )
 	{
-		mTrackerChannel = Channel::create( mTrackingResolution.x, mTrackingResolution.y );
+		snapshot->mCameraLabels.resize( mMosaicTiles.size() );
+		for ( size_t i = 0; i < mMosaicTiles.size(); i++ )
+		{
+			if ( ! mMosaicSources[ i ] )
+			{
+				continue;
+			}
+			auto &label = snapshot->mCameraLabels[ numLabels++ ];
+			label.mText = recording ? mDepthPlayer->getCameraLabel( i ) : mOniCameraManager->getCameraLabel( i );
+			label.mPos = mMosaicTiles[ i ].mSrcArea.getUL() + mMosaicTiles[ i ].mOffset;
+		}
 	}
+	snapshot->mNumCameraLabels = numLabels;
+
+	// the previous result is released on the pipeline thread, see ChannelView::getResult()
+	snapshot->mChannelViewResult = mChannelView.getResult();
 
-	if ( mTrackingSourceMode == TrackingSourceMode::CAMERA )
+	snapshot->mSerialMessage = serialMessage;
+
+	mReadySnapshots.push( snapshotId );
+}
+
+void MetronomeApp::updateTracking()
+{
+	const PipelineSettings &settings = mPipelineSettings;
+	bool inputChanged = mTrackingChanged.exchange( false );
+	bool depthBand = false;
+
+	// the tracker channel is only reallocated when the resolution actually changes
+	if ( ! mTrackerChannel || ( mTrackerChannel->getSize() != settings.mTrackingResolution ) )
 	{
-		ip::fill( mTrackerChannel.get(), (uint8_t)0 );
+		mTrackerChannel = Channel::create( settings.mTrackingResolution.x, settings.mTrackingResolution.y );
+		inputChanged = true;
+	}
 
+	if ( settings.mTrackingSourceMode == TrackingSourceMode::CAMERA )
+	{
 		size_t numCameras = math< size_t >::min( kNumCameras, mOniCameraManager->getNumCameras() );
+		updateMosaicTiles( numCameras );
 		for ( size_t i = 0; i < numCameras; i++ )
 		{
-			ChannelRef camChannel = mOniCameraManager->getCameraChannel( i );
-			if ( camChannel )
+			const auto &frame = mOniCameraManager->getCameraFrame( i );
+			if ( frame.mSequence != mCameraSequences[ i ] )
 			{
-				Area srcArea = mCameraData[ i ].mSrcArea.getClipBy( camChannel->getBounds() );
-				mTrackerChannel->copyFrom( *camChannel, srcArea, mCameraData[ i ].mOffset );
+				mCameraSequences[ i ] = frame.mSequence;
+				inputChanged = true;
 			}
+			mMosaicSources[ i ] = frame.mChannel;
+			depthBand = depthBand || ( frame.mChannel && frame.mDepthBand );
+		}
+
+		if ( inputChanged )
+		{
+			mMosaicCompositor->update( mMosaicTiles, mMosaicSources, mTrackerChannel.get() );
 		}
 	}
 	else
-	if ( mTrackingSourceMode == TrackingSourceMode::IMAGE && mImage )
+	if ( settings.mTrackingSourceMode == TrackingSourceMode::RECORDING && mDepthPlayer )
 	{
-		ip::resize( *mImage, mImage->getBounds(), mTrackerChannel.get(), mTrackerChannel->getBounds() );
+		mDepthPlayer->setRealtime( settings.mReplayRealtime );
+		// the band is tuned on paused or non-realtime replays as well, the current frames are segmented again
+		if ( mDepthPlayer->setDepthBand( static_cast< uint16_t >( settings.mReplayDepthNear ),
+										 static_cast< uint16_t >( settings.mReplayDepthFar ) ) )
+		{
+			inputChanged = true;
+		}
+		if ( mDepthPlayer->update( getElapsedSeconds() ) )
+		{
+			inputChanged = true;
+		}
+		mReplayPosition = float( mDepthPlayer->getPosition() );
+
+		size_t numCameras = math< size_t >::min( kNumCameras, mDepthPlayer->getNumCameras() );
+		updateMosaicTiles( numCameras );
+		for ( size_t i = 0; i < numCameras; i++ )
+		{
+			const auto &frame = mDepthPlayer->getFrame( i );
+			mMosaicSources[ i ] = frame.mSequence ? frame.mChannel : ChannelRef();
+			depthBand = depthBand || ( frame.mSequence && frame.mDepthBand );
+		}
+
+		if ( inputChanged )
+		{
+			mMosaicCompositor->update( mMosaicTiles, mMosaicSources, mTrackerChannel.get() );
+		}
+	}
+	else
+	if ( settings.mTrackingSourceMode == TrackingSourceMode::IMAGE && mImage )
+	{
+		if ( inputChanged )
+		{
+			// tracker parameter changes reuse the resampled image
+			if ( ( mResizedImageSource != mImage ) || ( mResizedImage.getSize() != mTrackerChannel->getSize() ) )
+			{
+				if ( mResizedImage.getSize() != mTrackerChannel->getSize() )
+				{
+					mResizedImage = Channel8u( mTrackerChannel->getWidth(), mTrackerChannel->getHeight() );
+				}
+				ip::resize( *mImage, mImage->getBounds(), &mResizedImage, mResizedImage.getBounds() );
+				mResizedImageSource = mImage;
+			}
+			mTrackerChannel->copyFrom( mResizedImage, mResizedImage.getBounds() );
+		}
 	}
-	else // movie
-	if ( mMovie && mMovie->checkNewFrame() )
+#if ! defined( CINDER_LINUX )
+	else
+	if ( settings.mTrackingSourceMode == TrackingSourceMode::MOVIE && mMovie && mMovie->checkNewFrame() )
 	{
 		Channel8u movieChannel( *mMovie->getSurface() );
 		ip::resize( movieChannel, movieChannel.getBounds(), mTrackerChannel.get(), mTrackerChannel->getBounds() );
+		inputChanged = true;
 	}
+#endif
 
-	mBlobTracker->update( *mTrackerChannel );
+	if ( depthBand != mDepthBandInput )
+	{
+		mDepthBandInput = depthBand;
+		inputChanged = true;
+	}
+	updateInputTrackerOptions( depthBand );
 
-	Rectf outputRect = Rectf( mTrackerChannel->getBounds() ).getCenteredFit( getWindowBounds(), true );
-	mCellDetector->resize( outputRect );
+	mCellDetector->setFrameSize( mTrackerChannel->getSize() );
+
+	// the blob tracker is idle in pixel coverage mode, its blobs are stale when switching back
+	const CellDetector::DetectionMode detectionMode = mCellDetector->getDetectionMode();
+	if ( detectionMode != mTrackedDetectionMode )
+	{
+		mTrackedDetectionMode = detectionMode;
+		inputChanged = true;
+	}
+
+	// pixel coverage detection works on the tracker input directly, without blob tracking
+	if ( detectionMode == CellDetector::DetectionMode::PIXEL_COVERAGE )
+	{
+		if ( inputChanged )
+		{
+			mTrackerGeneration++;
+		}
+		const auto &trackerOptions = mInputTrackerOptions;
+		mCellDetector->update( *mTrackerChannel, static_cast< uint8_t >( trackerOptions.mThreshold ),
+							   trackerOptions.mThresholdInvertEnabled, trackerOptions.mFlip,
+							   mTrackerGeneration );
+		return;
+	}
+
+	if ( updateTrackerCrop() )
+	{
+		inputChanged = true;
+	}
+
+	if ( inputChanged )
+	{
+		// the cropped channel points into the tracker channel, no pixels are copied
+		Channel8u croppedChannel( mTrackerCropArea.getWidth(), mTrackerCropArea.getHeight(),
+								  mTrackerChannel->getRowBytes(), 1,
+								  mTrackerChannel->getData( mTrackerCropArea.getUL() ) );
+
+		updateCroppedTrackerOptions();
+		mBlobTracker->update( croppedChannel );
+		mTrackerGeneration++;
+	}
+
+	mCellDetector->update( mBlobTracker->getBlobs(), mTrackerGeneration, mNormalizedTrackerCrop );
+}
+
+size_t MetronomeApp::getNumTracked() const
+{
+	if ( mCellDetector->getDetectionMode() == CellDetector::DetectionMode::PIXEL_COVERAGE )
+	{
+		return mCellDetector->getBlobCellCoords().size();
+	}
+	return mBlobTracker->getNumBlobs();
+}
+
+bool MetronomeApp::updateTrackerCrop()
+{
+	const auto &trackerOptions = mInputTrackerOptions;
+
+	// the flipped frame has no fixed relation to the grid area, it is tracked as a whole
+	Rectf crop( 0.0f, 0.0f, 1.0f, 1.0f );
+	if ( ! trackerOptions.mFlip )
+	{
+		crop = mCellDetector->getNormalizedGridBounds();
+		if ( trackerOptions.mBoundsEnabled )
+		{
+			const Rectf &roi = trackerOptions.mNormalizedRegionOfInterest;
+			crop = Rectf( math< float >::min( crop.x1, roi.x1 ), math< float >::min( crop.y1, roi.y1 ),
+						  math< float >::max( crop.x2, roi.x2 ), math< float >::max( crop.y2, roi.y2 ) );
+		}
+	}
+
+	// blobs crossing the border are kept whole by a margin of the blur size
+	const vec2 size( mTrackerChannel->getSize() );
+	const int margin = trackerOptions.mBlurSize;
+	Area cropArea( int( crop.x1 * size.x ) - margin, int( crop.y1 * size.y ) - margin,
+				   int( std::ceil( crop.x2 * size.x ) ) + margin, int( std::ceil( crop.y2 * size.y ) ) + margin );
+	cropArea = cropArea.getClipBy( mTrackerChannel->getBounds() );
+	if ( ( cropArea.getWidth() <= 0 ) || ( cropArea.getHeight() <= 0 ) )
+	{
+		cropArea = mTrackerChannel->getBounds();
+	}
+	const bool cropChanged = ! ( cropArea == mTrackerCropArea );
+	mTrackerCropArea = cropArea;
+	mNormalizedTrackerCrop = Rectf( vec2( cropArea.getUL() ) / size, vec2( cropArea.getLR() ) / size );
+	return cropChanged;
+}
 
-	mCellDetector->update( mBlobTracker->getBlobs() );
+void MetronomeApp::updateInputTrackerOptions( bool depthBand )
+{
+	mInputTrackerOptions = mPipelineSettings.mBlobTrackerOptions;
+	if ( depthBand )
+	{
+		// the mask is binary already, blurring would move its edges and inverting would track the background
+		mInputTrackerOptions.mBlurSize = 1;
+		mInputTrackerOptions.mThreshold = 127;
+		mInputTrackerOptions.mThresholdInvertEnabled = false;
+	}
+}
+
+void MetronomeApp::updateCroppedTrackerOptions()
+{
+	const auto &trackerOptions = mInputTrackerOptions;
+
+	mCroppedTrackerOptions = trackerOptions;
+
+	// roi and area limits are given relative to the full frame
+	const vec2 cropSize = mNormalizedTrackerCrop.getSize();
+	const Rectf &roi = trackerOptions.mNormalizedRegionOfInterest;
+	mCroppedTrackerOptions.mNormalizedRegionOfInterest =
+		Rectf( ( roi.getUpperLeft() - mNormalizedTrackerCrop.getUpperLeft() ) / cropSize,
+			   ( roi.getLowerRight() - mNormalizedTrackerCrop.getUpperLeft() ) / cropSize );
+	const float areaScale = 1.0f / ( cropSize.x * cropSize.y );
+	mCroppedTrackerOptions.mMinArea = trackerOptions.mMinArea * areaScale;
+	mCroppedTrackerOptions.mMaxArea = trackerOptions.mMaxArea * areaScale;
+}
+
+void MetronomeApp::updateMosaicTiles( size_t numCameras )
+{
+	const PipelineSettings &settings = mPipelineSettings;
+	mMosaicTiles.resize( numCameras );
+	mMosaicSources.resize( numCameras );
+	mCameraSequences.resize( numCameras, 0 );
+	for ( size_t i = 0; i < numCameras; i++ )
+	{
+		mMosaicTiles[ i ].mSrcArea = settings.mCameraData[ i ].mSrcArea;
+		mMosaicTiles[ i ].mOffset = settings.mCameraData[ i ].mOffset;
+	}
 }
 
 void MetronomeApp::draw()
@@ -478,8 +1230,25 @@ void MetronomeApp::draw()
 	gl::setMatricesWindow( getWindowSize() );
 
 	gl::clear( Color( 0.4, 0.4, 0.4 ), true );
-    
-	drawTracking();
+
+	// keep the freshest published snapshot, hand the previous ones back to the pipeline
+	size_t snapshotId;
+	while ( mReadySnapshots.pop( &snapshotId ) )
+	{
+		if ( mDrawnSnapshotId < kNumPipelineSnapshots )
+		{
+			mFreeSnapshots.push( mDrawnSnapshotId );
+		}
+		mDrawnSnapshotId = snapshotId;
+	}
+	if ( mDrawnSnapshotId >= kNumPipelineSnapshots )
+	{
+		mParams->draw();
+		return;
+	}
+	const PipelineSnapshot *snapshot = &mPipelineSnapshots[ mDrawnSnapshotId ];
+
+	drawTracking( *snapshot );
 
 	mOniCameraManager->draw();
 
@@ -487,42 +1256,128 @@ void MetronomeApp::draw()
 
 	if ( mDebugEnabled )
 	{
-		displayMetronomes( mChannelView.getRawResultAsVector(), mChannelView.getBpmResultAsVector() );
+		displayMetronomes( *snapshot->mChannelViewResult );
         displayCells();
-        displaySerial();
+        displaySerial( snapshot->mSerialMessage );
 	}
 
 	mParams->draw();
 }
 
-void MetronomeApp::drawTracking()
+void MetronomeApp::drawTracking( const PipelineSnapshot &snapshot )
 {
-	Rectf outputRect = Rectf( mTrackerChannel->getBounds() ).getCenteredFit( getWindowBounds(), true );
-	gl::draw( gl::Texture2d::create( *mTrackerChannel ), outputRect );
+	const Channel8u &trackerChannel = snapshot.mTrackerChannel;
 
-	RectMapping mapping( mTrackerChannel->getBounds(), outputRect );
-	size_t numCameras = math< size_t >::min( kNumCameras, mOniCameraManager->getNumCameras() );
-	for ( size_t i = 0; i < numCameras; i++ )
+	// the texture is only uploaded when the tracker input has changed
+	if ( ! mTrackerTexture || ( mTrackerTexture->getSize() != trackerChannel.getSize() ) )
+	{
+		mTrackerTexture = gl::Texture2d::create( trackerChannel );
+		mTrackerTextureGeneration = snapshot.mTrackerGeneration;
+	}
+	else
+	if ( mTrackerTextureGeneration != snapshot.mTrackerGeneration )
+	{
+		mTrackerTexture->update( trackerChannel );
+		mTrackerTextureGeneration = snapshot.mTrackerGeneration;
+	}
+
+	Rectf outputRect = Rectf( trackerChannel.getBounds() ).getCenteredFit( getWindowBounds(), true );
+	gl::draw( mTrackerTexture, outputRect );
+	mCellDetector->resize( outputRect );
+
+	RectMapping mapping( trackerChannel.getBounds(), outputRect );
+	for ( size_t i = 0; i < snapshot.mNumCameraLabels; i++ )
 	{
 		const ivec2 margin( 16 );
-		ChannelRef camChannel = mOniCameraManager->getCameraChannel( i );
-		if ( camChannel )
+		const auto &label = snapshot.mCameraLabels[ i ];
+		gl::drawString( label.mText, mapping.map( vec2( label.mPos + margin ) ) );
+	}
+
+	if ( mDebugOptions.mDebugMode != mndl::blobtracker::DebugDrawer::Options::DebugMode::NONE )
+	{
+		// only retracked when the snapshot has new tracker input
+		if ( mDebugTrackerGeneration != snapshot.mTrackerGeneration )
 		{
-			std::string label = mOniCameraManager->getCameraLabel( i );
-			ivec2 offset = mCameraData[ i ].mSrcArea.getUL() +
-							mCameraData[ i ].mOffset + margin;
-			gl::drawString( label, mapping.map( offset ) );
+			Area cropArea = snapshot.mTrackerCropArea.getClipBy( trackerChannel.getBounds() );
+			if ( ( cropArea.getWidth() <= 0 ) || ( cropArea.getHeight() <= 0 ) )
+			{
+				cropArea = trackerChannel.getBounds();
+			}
+			if ( mDebugTrackerInput.getSize() != cropArea.getSize() )
+			{
+				mDebugTrackerInput = Channel8u( cropArea.getWidth(), cropArea.getHeight() );
+			}
+			mDebugTrackerInput.copyFrom( trackerChannel, cropArea, -cropArea.getUL() );
+			mDebugTrackerCropArea = cropArea;
+			mDebugTrackerOptions = snapshot.mTrackerOptions;
+			mDebugBlobTracker->update( mDebugTrackerInput );
+			mDebugTrackerGeneration = snapshot.mTrackerGeneration;
 		}
+		// the debug view covers the tracked crop of the tracker texture
+		const Area debugBounds( mapping.map( Rectf( mDebugTrackerCropArea ) ) );
+		mndl::blobtracker::DebugDrawer::draw( mDebugBlobTracker, debugBounds, mDebugOptions );
+	}
+}
+
+void MetronomeApp::loadImageSource( const fs::path &imagePath )
+{
+	if ( mImageLoadThread )
+	{
+		mImageLoadThread->join();
 	}
 
-	mndl::blobtracker::DebugDrawer::draw( mBlobTracker, getWindowBounds(), mDebugOptions );
+	// decoding large images would block the ui, the pipeline gets the image when it is ready
+	mImageLoadThread =
+		std::shared_ptr< std::thread >( new std::thread( [ this, imagePath ]()
+			{
+				ChannelRef image;
+				try
+				{
+					image = Channel::create( loadImage( imagePath ) );
+				}
+				catch ( const ImageIoException & )
+				{
+					CI_LOG_E( "Could not load image " << imagePath.string() );
+					return;
+				}
+				runOnPipelineThread( [ this, image ]()
+						{
+							mImage = image;
+							mTrackingChanged = true;
+						} );
+			} ) );
 }
 
+#if ! defined( CINDER_LINUX )
 void MetronomeApp::loadMovie( const fs::path &moviePath )
 {
-	mMovie = qtime::MovieSurface::create( moviePath );
-	mMovie->setLoop();
-	mMovie->play();
+	qtime::MovieSurfaceRef movie = qtime::MovieSurface::create( moviePath );
+	movie->setLoop();
+	movie->play();
+	runOnPipelineThread( [ this, movie ]() { mMovie = movie; } );
+}
+#endif
+
+void MetronomeApp::loadRecording( const fs::path &recordingPath )
+{
+	DepthPlayerRef player;
+	try
+	{
+		player = DepthPlayer::create( recordingPath );
+	}
+	catch ( const depthrecording::ExcDepthRecording &exc )
+	{
+		CI_LOG_E( exc.what() );
+		return;
+	}
+
+	CI_LOG_I( recordingPath.string() << ": " << player->getNumCameras() << " cameras, " <<
+			  player->getNumFrames() << " frames, " << player->getDuration() << "s" );
+	runOnPipelineThread( [ this, player ]()
+			{
+				mDepthPlayer = player;
+				mTrackingChanged = true;
+			} );
 }
 
 void MetronomeApp::mouseMove( MouseEvent event )
@@ -552,32 +1407,34 @@ void MetronomeApp::displayCells( )
 	gl::color( Color::white() );
 }
 
-void MetronomeApp::displaySerial( )
+void MetronomeApp::displaySerial( const string &message )
 {
     gl::ScopedAlphaBlend blend( false );
     gl::color( Color::ColorT( 0.8, 0.8, 0.2 ) );
-            mTextureFont->drawString( serialMessage, vec2(20, getWindowHeight() - 100) );
+            mTextureFont->drawString( message, vec2(20, getWindowHeight() - 100) );
     gl::color( Color::white() );
 }
 
 
-void MetronomeApp::displayMetronomes( std::vector< int > rawResult, std::vector< int > bpmResult )
+void MetronomeApp::displayMetronomes( const ChannelView::Result &result )
 {
     gl::ScopedAlphaBlend blend( false );
     
     int c = 0;
     const GlobalData &gd = GlobalData::get();
-    for ( int y = 0; y < 10; y++ )
+    const int width = result.mSize.x;
+    const int height = result.mSize.y;
+    for ( int y = 0; y < height; y++ )
     {
-        for ( int x = 0; x < 10; x++ )
+        for ( int x = 0; x < width; x++ )
         {
             gl::color( Color::ColorT( 0.6, 0.6, 0.6 ) );
-            std::string rawValue = toString(rawResult[c]);
-            mTextureFont->drawString( "val: " + rawValue, vec2( x / (float)10 * (getWindowWidth()-getWindowWidth()/(gd.mGridSize + 2)) + getWindowWidth()/(gd.mGridSize + 2), y / (float)10 * getWindowHeight() + 10) ) ;
+            std::string rawValue = toString(result.mRaw[c]);
+            mTextureFont->drawString( "val: " + rawValue, vec2( x / (float)width * (getWindowWidth()-getWindowWidth()/(gd.mGridSize + 2)) + getWindowWidth()/(gd.mGridSize + 2), y / (float)height * getWindowHeight() + 10) ) ;
             
             gl::color( Color::ColorT( 1, 0.2, 0.2 ) );
-            std::string bpmValue = toString(bpmResult[c]);
-            mTextureFont->drawString( "bpm: " + bpmValue, vec2( x / (float)10 * (getWindowWidth()-getWindowWidth()/(gd.mGridSize + 2)) + getWindowWidth()/(gd.mGridSize + 2), y / (float)10 * getWindowHeight() + 20) ) ;
+            std::string bpmValue = toString(result.mBpm[c]);
+            mTextureFont->drawString( "bpm: " + bpmValue, vec2( x / (float)width * (getWindowWidth()-getWindowWidth()/(gd.mGridSize + 2)) + getWindowWidth()/(gd.mGridSize + 2), y / (float)height * getWindowHeight() + 20) ) ;
             
             c++;
         }
@@ -586,6 +1443,7 @@ void MetronomeApp::displayMetronomes( std::vector< int > rawResult, std::vector<
 }
 
 void MetronomeApp::sendSequencedSerial( vector< int > v ) {
+    forgetSentBpms();
     if( mSerial ) {
         int counter = 1;
         try {
@@ -611,6 +1469,7 @@ void MetronomeApp::sendSequencedSerial( vector< int > v ) {
 }
 
 void MetronomeApp::sendMultiStringSerial( vector< string > multiString) {
+    forgetSentBpms();
     if( mSerial ) {
         try {
             for( auto s : multiString ) {
@@ -628,6 +1487,7 @@ void MetronomeApp::sendMultiStringSerial( vector< string > multiString) {
 }
 
 void MetronomeApp::sendStopSerial() {
+    forgetSentBpms();
     if( mSerial ) {
         try {
             //mSerial->writeString( "Set Stop_all\n" );
@@ -642,6 +1502,7 @@ void MetronomeApp::sendStopSerial() {
 }
 
 void MetronomeApp::sendResetSerial() {
+    forgetSentBpms();
     if( mSerial ) {
         try {
             //mSerial->writeString( "Set Stop_all\n" );
@@ -657,6 +1518,7 @@ void MetronomeApp::sendResetSerial() {
 }
 
 void MetronomeApp::sendOneSerial() {
+    forgetSentBpms();
     if( mSerial ) {
         try {
             //mSerial->writeString( "Set Stop_all\n" );
@@ -672,6 +1534,7 @@ void MetronomeApp::sendOneSerial() {
 }
 
 void MetronomeApp::sendTwoSerials() {
+    forgetSentBpms();
     if( mSerial ) {
         try {
             mSerial->writeString( "Set 2 BPM 200 25\n" );
@@ -685,24 +1548,50 @@ void MetronomeApp::sendTwoSerials() {
     }
 }
 
-void MetronomeApp::sendIndexedSerials( int index, std::vector< int > bpmEven, std::vector< int > bpmOdd ) {
+bool MetronomeApp::sendIndexedSerials( int index, const std::vector< int > &bpmEven, const std::vector< int > &bpmOdd ) {
     if( mSerial ) {
         try {
             mSerial->writeString( "Set "+ to_string( index + 1 ) + " BPM " + to_string( bpmEven[ index ] ) + " " + to_string( bpmOdd[ index ] ) + "\n" );
     
             //cout << "Set "+ to_string( index + 1 ) + " BPM " + to_string( bpmEven[ index ] ) + " " + to_string( bpmOdd[ index ] ) + "\n";
+            return true;
         }
         catch ( SerialExcWriteFailure ) {
             serialMessage = "Serial error: could not send";
             cout << "Serial error: could not send" << endl;
         }
     }
+    return false;
+}
+
+void MetronomeApp::sendChangedIndexedSerials( int index, const std::vector< int > &bpmEven, const std::vector< int > &bpmOdd ) {
+    //  the bpm of a device depends on the whole field, so the sweep compares the values instead of the cells,
+    //  a stable occupancy keeps the bus quiet apart from the sync
+    if( sentBpmEven.size() != bpmEven.size() || sentBpmOdd.size() != bpmOdd.size() ) {
+        sentBpmEven.assign( bpmEven.size(), -1 );
+        sentBpmOdd.assign( bpmOdd.size(), -1 );
+    }
+    if( sentBpmEven[ index ] == bpmEven[ index ] && sentBpmOdd[ index ] == bpmOdd[ index ] ) {
+        return;
+    }
+    if( sendIndexedSerials( index, bpmEven, bpmOdd ) ) {
+        sentBpmEven[ index ] = bpmEven[ index ];
+        sentBpmOdd[ index ] = bpmOdd[ index ];
+    }
+}
+
+void MetronomeApp::forgetSentBpms() {
+    //  the next sweep sets every device again
+    sentBpmEven.clear();
+    sentBpmOdd.clear();
 }
 
 void MetronomeApp::sendSync() {
     if( mSerial ) {
         try {
             mSerial->writeString( "Start\n" );
+            // the preview ticks from the same moment as the metronomes
+            mSound.sync();
             serialMessage = "Reset_t_all\n";
             serialMessage = "Reset_t_all\n";
             mSerial->flush();
@@ -789,43 +1678,43 @@ void MetronomeApp::keyDown( KeyEvent event )
 			}
 			break;
         case KeyEvent::KEY_1:
-            sendStopSerial();
+            runOnPipelineThread( [ this ]() { sendStopSerial(); } );
             break;
         
         case KeyEvent::KEY_2:
-            sendResetSerial();
+            runOnPipelineThread( [ this ]() { sendResetSerial(); } );
             break;
             
         case KeyEvent::KEY_3:
-            sendMultiStringSerial( mChannelView.getBpmResultAsMultiString() );
+            runOnPipelineThread( [ this ]() { sendMultiStringSerial( mChannelView.getBpmResultAsMultiString() ); } );
             break;
         
         case KeyEvent::KEY_4:
-            sendOneSerial();
+            runOnPipelineThread( [ this ]() { sendOneSerial(); } );
             break;
             
         case KeyEvent::KEY_5:
-            sendTwoSerials();
+            runOnPipelineThread( [ this ]() { sendTwoSerials(); } );
             break;
             
         case KeyEvent::KEY_6:
-            canSendIndexed = true;
+            runOnPipelineThread( [ this ]() { forgetSentBpms(); canSendIndexed = true; } );
             break;
             
         case KeyEvent::KEY_7:
-            sendMultiStringSerial( mChannelView.getBpmResultAsFixedMultiString() );
+            runOnPipelineThread( [ this ]() { sendMultiStringSerial( mChannelView.getBpmResultAsFixedMultiString() ); } );
             break;
         
         case KeyEvent::KEY_8:
-            sendSync();
+            runOnPipelineThread( [ this ]() { sendSync(); } );
             break;
             
         case KeyEvent::KEY_9:
-            sendOneSync();
+            runOnPipelineThread( [ this ]() { sendOneSync(); } );
             break;
             
         case KeyEvent::KEY_b:
-            sendStartSerial();
+            runOnPipelineThread( [ this ]() { sendStartSerial(); } );
             break;
             
 		case KeyEvent::KEY_ESCAPE:
@@ -839,6 +1728,21 @@ void MetronomeApp::keyDown( KeyEvent event )
 
 void MetronomeApp::cleanup()
 {
+	if ( mImageLoadThread )
+	{
+		mImageLoadThread->join();
+	}
+	if ( mRenderThread )
+	{
+		mRenderThread->join();
+	}
+
+	mPipelineRunning = false;
+	if ( mPipelineThread )
+	{
+		mPipelineThread->join();
+	}
+
 	writeConfig();
 }
 
@@ -856,6 +1760,8 @@ void MetronomeApp::readConfig()
 		gd.mConfig->read( loadFile( configPath ) );
 		mndl::params::readParamsLayout();
 	}
+	mCellDetector->commitParams();
+	mChannelView.commitParams();
 }
 
 void MetronomeApp::writeConfig()
@@ -0,0 +1,73 @@
+#include <algorithm>
+#include <cmath>
+#include <random>
+
+#include "MetronomeEnsemble.h"
+
+void MetronomeEnsemble::setup( size_t numVoices, uint32_t seed )
+{
+	mNumVoices = numVoices;
+
+	// tempo errors of a few tenths of a percent, springs lasting noticeably longer or shorter
+	std::mt19937 rng( seed );
+	std::normal_distribution< float > detune( 1.0f, 0.004f );
+	std::normal_distribution< float > escapementLoss( 1.0f, 0.15f );
+	mDetune.resize( numVoices );
+	mEscapementLoss.resize( numVoices );
+	for ( size_t i = 0; i < numVoices; i++ )
+	{
+		mDetune[ i ] = detune( rng );
+		mEscapementLoss[ i ] = std::min( std::max( escapementLoss( rng ), 0.5f ), 1.5f );
+	}
+
+	mTargetFreq.assign( numVoices, 0.0f );
+	mEnergy.assign( numVoices, 0.0f );
+	mFreq.assign( numVoices, 0.0f );
+	mGain.assign( numVoices, 0.0f );
+}
+
+void MetronomeEnsemble::wind()
+{
+	std::fill( mEnergy.begin(), mEnergy.end(), 1.0f );
+	update( 0.0f );
+}
+
+void MetronomeEnsemble::update( float seconds )
+{
+	// energy taken by one beat, a metronome at 120 bpm runs for mRunTime seconds
+	const float energyPerBeat = 1.0f / ( std::max( mRunTime, 1.0f ) * 2.0f );
+	const float beatLoss = energyPerBeat * seconds;
+	const float slowdown = mSlowdown;
+
+	const float *detune = mDetune.data();
+	const float *escapementLoss = mEscapementLoss.data();
+	const float *targetFreq = mTargetFreq.data();
+	float *energy = mEnergy.data();
+	float *freq = mFreq.data();
+	float *gain = mGain.data();
+
+	// the metronomes are independent, the loop has no dependency between iterations
+	for ( size_t i = 0; i < mNumVoices; i++ )
+	{
+		const float e = std::max( energy[ i ] - freq[ i ] * beatLoss * escapementLoss[ i ], 0.0f );
+		energy[ i ] = e;
+		freq[ i ] = ( e > 0.0f ) ? targetFreq[ i ] * detune[ i ] * ( 1.0f - slowdown * ( 1.0f - e ) ) : 0.0f;
+		// the swing amplitude and the loudness of the tick follow the square root of the energy
+		gain[ i ] = std::sqrt( e );
+	}
+}
+
+void MetronomeEnsemble::apply( MetronomeSynth *synth ) const
+{
+	const size_t numVoices = std::min( mNumVoices, synth->getNumVoices() );
+	for ( size_t i = 0; i < numVoices; i++ )
+	{
+		synth->bendVoice( i, mFreq[ i ] );
+		synth->setVoiceGain( i, mGain[ i ] );
+	}
+}
+
+size_t MetronomeEnsemble::getNumRunning() const
+{
+	return size_t( std::count_if( mEnergy.begin(), mEnergy.end(), []( float e ) { return e > 0.0f; } ) );
+}
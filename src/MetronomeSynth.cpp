@@ -0,0 +1,136 @@
+#include <algorithm>
+#include <cmath>
+
+#include "MetronomeSynth.h"
+
+void MetronomeSynth::setup( size_t numVoices, float sampleRate, size_t numChannels )
+{
+	mNumVoices = numVoices;
+	mNumPaddedVoices = ( numVoices + kNumLanes - 1 ) / kNumLanes * kNumLanes;
+	mNumChannels = std::max< size_t >( numChannels, 1 );
+	mSampleRate = sampleRate;
+
+	mFreq.assign( mNumPaddedVoices, 0.0f );
+	mCenterFreq.assign( mNumPaddedVoices, 0.0f );
+	mVoiceGain.assign( mNumPaddedVoices, 1.0f );
+	mPhase.assign( mNumPaddedVoices, 0.0f );
+	mPhaseIncrement.assign( mNumPaddedVoices, 0.0f );
+	mB0.assign( mNumPaddedVoices, 0.0f );
+	mA1.assign( mNumPaddedVoices, 0.0f );
+	mA2.assign( mNumPaddedVoices, 0.0f );
+	mZ1.assign( mNumPaddedVoices, 0.0f );
+	mZ2.assign( mNumPaddedVoices, 0.0f );
+	mVoiceOut.assign( mNumPaddedVoices, 0.0f );
+
+	mClickEngine.setup( mNumVoices, mSampleRate, mNumChannels );
+}
+
+void MetronomeSynth::setVoice( size_t i, float freq, float centerFreq )
+{
+	mFreq[ i ] = freq;
+	mCenterFreq[ i ] = centerFreq;
+	mPhaseIncrement[ i ] = freq / mSampleRate;
+
+	// band-pass with a peak gain of 1 ( Bristow-Johnson, Audio EQ Cookbook ), as audio::FilterBandPassNode
+	const float w0 = 2.0f * float( M_PI ) * std::min( std::max( centerFreq, 0.0f ), 0.5f * mSampleRate ) / mSampleRate;
+	const float alpha = std::sin( w0 ) / ( 2.0f * mQ );
+	const float a0 = 1.0f + alpha;
+	mB0[ i ] = alpha / a0;
+	mA1[ i ] = -2.0f * std::cos( w0 ) / a0;
+	mA2[ i ] = ( 1.0f - alpha ) / a0;
+
+	mClickEngine.setVoice( i, freq, centerFreq );
+}
+
+void MetronomeSynth::bendVoice( size_t i, float freq )
+{
+	mFreq[ i ] = freq;
+	mPhaseIncrement[ i ] = freq / mSampleRate;
+	mClickEngine.bendVoice( i, freq );
+}
+
+void MetronomeSynth::setVoiceGain( size_t i, float gain )
+{
+	mVoiceGain[ i ] = gain;
+	mClickEngine.setVoiceGain( i, gain );
+}
+
+void MetronomeSynth::restart()
+{
+	std::fill( mPhase.begin(), mPhase.end(), 0.0f );
+	mClickEngine.restart( mClickEngine.getSampleTime() );
+}
+
+void MetronomeSynth::process( float *const *channels, size_t numFrames )
+{
+	for ( size_t ch = 0; ch < mNumChannels; ch++ )
+	{
+		std::fill( channels[ ch ], channels[ ch ] + numFrames, 0.0f );
+	}
+
+	if ( mMode == Mode::CLICKS )
+	{
+		mClickEngine.process( channels, numFrames, mGain );
+	}
+	else
+	{
+		// the click engine keeps counting, so switching to clicks stays in time
+		processFilteredPhasors( channels, numFrames );
+		mClickEngine.advance( numFrames );
+	}
+}
+
+void MetronomeSynth::processFilteredPhasors( float *const *channels, size_t numFrames )
+{
+	float *phase = mPhase.data();
+	const float *phaseIncrement = mPhaseIncrement.data();
+	const float *b0 = mB0.data();
+	const float *a1 = mA1.data();
+	const float *a2 = mA2.data();
+	float *z1 = mZ1.data();
+	float *z2 = mZ2.data();
+	const float *voiceGain = mVoiceGain.data();
+	float *voiceOut = mVoiceOut.data();
+
+	for ( size_t f = 0; f < numFrames; f++ )
+	{
+		// the voices are independent, the loop has no dependency between iterations
+		for ( size_t i = 0; i < mNumPaddedVoices; i++ )
+		{
+			const float x = phase[ i ];
+			const float y = b0[ i ] * x + z1[ i ];
+			z1[ i ] = z2[ i ] - a1[ i ] * y;
+			z2[ i ] = -b0[ i ] * x - a2[ i ] * y;
+			const float next = x + phaseIncrement[ i ];
+			phase[ i ] = ( next >= 1.0f ) ? next - 1.0f : next;
+			voiceOut[ i ] = voiceGain[ i ] * y;
+		}
+
+		if ( mNumChannels == 1 )
+		{
+			// one partial sum per lane keeps the voices of a group independent
+			float lanes[ kNumLanes ] = {};
+			for ( size_t v = 0; v < mNumPaddedVoices; v += kNumLanes )
+			{
+				for ( size_t l = 0; l < kNumLanes; l++ )
+				{
+					lanes[ l ] += voiceOut[ v + l ];
+				}
+			}
+
+			float sum = 0.0f;
+			for ( size_t l = 0; l < kNumLanes; l++ )
+			{
+				sum += lanes[ l ];
+			}
+			channels[ 0 ][ f ] = mGain * sum;
+		}
+		else
+		{
+			for ( size_t i = 0; i < mNumVoices; i++ )
+			{
+				channels[ i % mNumChannels ][ f ] += mGain * voiceOut[ i ];
+			}
+		}
+	}
+}
@@ -0,0 +1,129 @@
+#include <chrono>
+
+#include "MetronomeSynthNode.h"
+
+using namespace ci;
+
+MetronomeSynthNode::MetronomeSynthNode( size_t numVoices, const Format &format ) :
+	audio::InputNode( format ),
+	mNumVoices( numVoices ),
+	mPublishedVersion( 0 ),
+	mAppliedVersion( 0 ),
+	mResetPhases( false ),
+	mMode( static_cast< int >( Mode::CLICKS ) ),
+	mWindDownEnabled( false ),
+	mWindRequested( false ),
+	mRunTime( 300.0f ),
+	mNumRunning( 0 ),
+	mLoad( 0.0f )
+{
+	setChannelMode( ChannelMode::SPECIFIED );
+	setNumChannels( 1 );
+
+	mEnsemble.setup( mNumVoices );
+
+	// the parameter blocks are never resized afterwards, publishing does not allocate
+	for ( size_t i = 0; i < mVoiceParams.kNumBuffers; i++ )
+	{
+		mVoiceParams.getBuffer( i ).mFreq.assign( mNumVoices, 0.0f );
+		mVoiceParams.getBuffer( i ).mCenterFreq.assign( mNumVoices, 0.0f );
+	}
+}
+
+void MetronomeSynthNode::setVoiceFrequencies( const std::vector< float > &freqs, const std::vector< float > &centerFreqs )
+{
+	// the back buffer holds an older block, all voices are written
+	VoiceParams &params = mVoiceParams.getBack();
+	for ( size_t i = 0; i < mNumVoices; i++ )
+	{
+		params.mFreq[ i ] = ( i < freqs.size() ) ? freqs[ i ] : 0.0f;
+		params.mCenterFreq[ i ] = ( i < centerFreqs.size() ) ? centerFreqs[ i ] : 0.0f;
+	}
+	params.mVersion = ++mPublishedVersion;
+	mVoiceParams.publish();
+}
+
+void MetronomeSynthNode::initialize()
+{
+	// the voices are set again from the last applied frequencies for the new sample rate
+	std::vector< float > freqs( mNumVoices );
+	std::vector< float > centerFreqs( mNumVoices );
+	for ( size_t i = 0; ( i < mNumVoices ) && ( i < mSynth.getNumVoices() ); i++ )
+	{
+		freqs[ i ] = mSynth.getVoiceFrequency( i );
+		centerFreqs[ i ] = mSynth.getVoiceCenterFrequency( i );
+	}
+
+	mSynth.setup( mNumVoices, float( getSampleRate() ) );
+	for ( size_t i = 0; i < mNumVoices; i++ )
+	{
+		mSynth.setVoice( i, freqs[ i ], centerFreqs[ i ] );
+	}
+}
+
+void MetronomeSynthNode::process( audio::Buffer *buffer )
+{
+	const auto startTime = std::chrono::steady_clock::now();
+	const size_t numFrames = buffer->getNumFrames();
+
+	// only the latest published block is applied, to the voices that changed. The ensemble
+	// keeps the published tempos, the synth voices may be bent by the wind-down.
+	if ( mVoiceParams.update() )
+	{
+		const VoiceParams &params = mVoiceParams.getFront();
+		for ( size_t i = 0; i < mNumVoices; i++ )
+		{
+			if ( ( mEnsemble.getTargetFrequency( i ) != params.mFreq[ i ] ) ||
+				 ( mSynth.getVoiceCenterFrequency( i ) != params.mCenterFreq[ i ] ) )
+			{
+				mSynth.setVoice( i, params.mFreq[ i ], params.mCenterFreq[ i ] );
+				mEnsemble.setVoice( i, params.mFreq[ i ] );
+			}
+		}
+		mAppliedVersion = params.mVersion;
+	}
+
+	if ( mResetPhases.exchange( false ) )
+	{
+		mSynth.restart();
+	}
+
+	if ( mWindRequested.exchange( false ) )
+	{
+		mEnsemble.wind();
+	}
+
+	if ( mWindDownEnabled )
+	{
+		// the metronomes start fully wound
+		if ( ! mWindDownActive )
+		{
+			mEnsemble.wind();
+		}
+		mEnsemble.setRunTime( mRunTime );
+		mEnsemble.update( float( numFrames / getSampleRate() ) );
+		mEnsemble.apply( &mSynth );
+		mNumRunning = mEnsemble.getNumRunning();
+		mWindDownActive = true;
+	}
+	else
+	if ( mWindDownActive )
+	{
+		// back to the published tempos at full volume
+		for ( size_t i = 0; i < mNumVoices; i++ )
+		{
+			mSynth.bendVoice( i, mEnsemble.getTargetFrequency( i ) );
+			mSynth.setVoiceGain( i, 1.0f );
+		}
+		mNumRunning = 0;
+		mWindDownActive = false;
+	}
+
+	mSynth.setMode( getMode() );
+	float *channels[] = { buffer->getData() };
+	mSynth.process( channels, numFrames );
+
+	const double elapsed = std::chrono::duration< double >( std::chrono::steady_clock::now() - startTime ).count();
+	static const float kLoadSmoothing = 0.95f;
+	mLoad = kLoadSmoothing * mLoad + ( 1.0f - kLoadSmoothing ) * float( elapsed * getSampleRate() / numFrames );
+}
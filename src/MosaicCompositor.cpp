@@ -0,0 +1,283 @@
+#include <algorithm>
+#include <cstring>
+
+#include "MosaicCompositor.h"
+
+using namespace ci;
+
+MosaicCompositor::MosaicCompositor( size_t numThreads ) :
+	mNextBand( 0 ),
+	mNumBandsDone( 0 )
+{
+	if ( numThreads == 0 )
+	{
+		size_t numCores = std::thread::hardware_concurrency();
+		numThreads = ( numCores > 1 ) ? numCores - 1 : 0;
+	}
+
+	for ( size_t i = 0; i < numThreads; i++ )
+	{
+		mWorkers.emplace_back( std::bind( &MosaicCompositor::workerThreadFn, this ) );
+	}
+}
+
+MosaicCompositor::~MosaicCompositor()
+{
+	{
+		std::lock_guard< std::mutex > lock( mMutex );
+		mQuit = true;
+	}
+	mStartCondition.notify_all();
+
+	for ( auto &worker : mWorkers )
+	{
+		worker.join();
+	}
+}
+
+void MosaicCompositor::update( const std::vector< Tile > &tiles, const std::vector< ChannelRef > &sources, Channel8u *target )
+{
+	if ( ! isPlanValid( tiles, sources, target ) )
+	{
+		calcPlan( tiles, sources, target );
+	}
+
+	mSources.resize( sources.size() );
+	for ( size_t i = 0; i < sources.size(); i++ )
+	{
+		mSources[ i ] = sources[ i ].get();
+	}
+	mTarget = target;
+
+	if ( mWorkers.empty() )
+	{
+		for ( const auto &band : mBands )
+		{
+			compositeBand( band );
+		}
+		return;
+	}
+
+	{
+		std::lock_guard< std::mutex > lock( mMutex );
+		mNextBand = 0;
+		mNumBandsDone = 0;
+		mFrameId++;
+	}
+	mStartCondition.notify_all();
+
+	// the calling thread takes its share of the bands as well
+	processBands();
+
+	std::unique_lock< std::mutex > lock( mMutex );
+	mDoneCondition.wait( lock, [ this ]() { return mNumBandsDone == mBands.size(); } );
+}
+
+bool MosaicCompositor::isPlanValid( const std::vector< Tile > &tiles, const std::vector< ChannelRef > &sources,
+									const Channel8u *target ) const
+{
+	if ( ( mPlanTargetSize != target->getSize() ) ||
+		 ( mPlanTiles.size() != tiles.size() ) ||
+		 ( mPlanSourceSizes.size() != sources.size() ) )
+	{
+		return false;
+	}
+
+	for ( size_t i = 0; i < tiles.size(); i++ )
+	{
+		if ( ! ( mPlanTiles[ i ].mSrcArea == tiles[ i ].mSrcArea ) ||
+			 ( mPlanTiles[ i ].mOffset != tiles[ i ].mOffset ) )
+		{
+			return false;
+		}
+	}
+
+	for ( size_t i = 0; i < sources.size(); i++ )
+	{
+		ivec2 size = sources[ i ] ? sources[ i ]->getSize() : ivec2( 0 );
+		if ( mPlanSourceSizes[ i ] != size )
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+void MosaicCompositor::calcPlan( const std::vector< Tile > &tiles, const std::vector< ChannelRef > &sources,
+								 const Channel8u *target )
+{
+	mPlanTiles = tiles;
+	mPlanTargetSize = target->getSize();
+	mPlanSourceSizes.resize( sources.size() );
+	for ( size_t i = 0; i < sources.size(); i++ )
+	{
+		mPlanSourceSizes[ i ] = sources[ i ] ? sources[ i ]->getSize() : ivec2( 0 );
+	}
+
+	// tiles clipped the same way as Channel::copyFrom does
+	mTilePlans.clear();
+	const Area targetBounds = target->getBounds();
+	for ( size_t i = 0; i < std::min( tiles.size(), sources.size() ); i++ )
+	{
+		if ( ! sources[ i ] )
+		{
+			continue;
+		}
+
+		Area srcArea = tiles[ i ].mSrcArea.getClipBy( sources[ i ]->getBounds() );
+		Area dstArea = srcArea + tiles[ i ].mOffset;
+		dstArea.clipBy( targetBounds );
+		if ( ( dstArea.getWidth() <= 0 ) || ( dstArea.getHeight() <= 0 ) )
+		{
+			continue;
+		}
+
+		TilePlan tilePlan;
+		tilePlan.mSourceId = i;
+		tilePlan.mDstPos = dstArea.getUL();
+		tilePlan.mSrcArea = dstArea - tiles[ i ].mOffset;
+		mTilePlans.push_back( tilePlan );
+	}
+
+	// uncovered spans from a coverage mask
+	const int32_t width = mPlanTargetSize.x;
+	const int32_t height = mPlanTargetSize.y;
+	std::vector< uint8_t > covered( width * height, 0 );
+	for ( const auto &tilePlan : mTilePlans )
+	{
+		const int32_t w = tilePlan.mSrcArea.getWidth();
+		for ( int32_t y = 0; y < tilePlan.mSrcArea.getHeight(); y++ )
+		{
+			uint8_t *row = &covered[ ( tilePlan.mDstPos.y + y ) * width + tilePlan.mDstPos.x ];
+			std::fill( row, row + w, uint8_t( 1 ) );
+		}
+	}
+
+	mClearSpans.clear();
+	std::vector< size_t > rowSpanBegin( height + 1 );
+	for ( int32_t y = 0; y < height; y++ )
+	{
+		rowSpanBegin[ y ] = mClearSpans.size();
+		const uint8_t *row = &covered[ y * width ];
+		int32_t x = 0;
+		while ( x < width )
+		{
+			if ( row[ x ] )
+			{
+				x++;
+				continue;
+			}
+			Span span;
+			span.mY = y;
+			span.mX1 = x;
+			while ( ( x < width ) && ! row[ x ] )
+			{
+				x++;
+			}
+			span.mX2 = x;
+			mClearSpans.push_back( span );
+		}
+	}
+	rowSpanBegin[ height ] = mClearSpans.size();
+
+	// horizontal bands, a few per thread for load balancing
+	mBands.clear();
+	const int32_t numBands = std::max< int32_t >( 1, std::min< int32_t >( height, 2 * ( mWorkers.size() + 1 ) ) );
+	for ( int32_t i = 0; i < numBands; i++ )
+	{
+		Band band;
+		band.mY1 = height * i / numBands;
+		band.mY2 = height * ( i + 1 ) / numBands;
+		band.mSpanBegin = rowSpanBegin[ band.mY1 ];
+		band.mSpanEnd = rowSpanBegin[ band.mY2 ];
+		mBands.push_back( band );
+	}
+
+	mNumPlanUpdates++;
+}
+
+void MosaicCompositor::compositeBand( const Band &band )
+{
+	const int32_t dstRowBytes = mTarget->getRowBytes();
+	const uint8_t dstIncrement = mTarget->getIncrement();
+	uint8_t *dstData = mTarget->getData();
+
+	for ( size_t i = band.mSpanBegin; i < band.mSpanEnd; i++ )
+	{
+		const Span &span = mClearSpans[ i ];
+		uint8_t *dst = dstData + span.mY * dstRowBytes + span.mX1 * dstIncrement;
+		if ( dstIncrement == 1 )
+		{
+			std::memset( dst, 0, span.mX2 - span.mX1 );
+		}
+		else
+		{
+			for ( int32_t x = span.mX1; x < span.mX2; x++, dst += dstIncrement )
+			{
+				*dst = 0;
+			}
+		}
+	}
+
+	// tiles are processed in order, so later cameras overwrite earlier ones like before
+	for ( const auto &tilePlan : mTilePlans )
+	{
+		const Channel8u *src = mSources[ tilePlan.mSourceId ];
+		const int32_t y1 = std::max( band.mY1, tilePlan.mDstPos.y );
+		const int32_t y2 = std::min( band.mY2, tilePlan.mDstPos.y + tilePlan.mSrcArea.getHeight() );
+		const int32_t width = tilePlan.mSrcArea.getWidth();
+		const uint8_t srcIncrement = src->getIncrement();
+
+		for ( int32_t y = y1; y < y2; y++ )
+		{
+			const uint8_t *srcRow = src->getData( ivec2( tilePlan.mSrcArea.x1,
+														 tilePlan.mSrcArea.y1 + y - tilePlan.mDstPos.y ) );
+			uint8_t *dstRow = dstData + y * dstRowBytes + tilePlan.mDstPos.x * dstIncrement;
+			if ( ( srcIncrement == 1 ) && ( dstIncrement == 1 ) )
+			{
+				std::memcpy( dstRow, srcRow, width );
+			}
+			else
+			{
+				for ( int32_t x = 0; x < width; x++ )
+				{
+					dstRow[ x * dstIncrement ] = srcRow[ x * srcIncrement ];
+				}
+			}
+		}
+	}
+}
+
+void MosaicCompositor::processBands()
+{
+	size_t bandId;
+	while ( ( bandId = mNextBand++ ) < mBands.size() )
+	{
+		compositeBand( mBands[ bandId ] );
+		if ( ++mNumBandsDone == mBands.size() )
+		{
+			std::lock_guard< std::mutex > lock( mMutex );
+			mDoneCondition.notify_one();
+		}
+	}
+}
+
+void MosaicCompositor::workerThreadFn()
+{
+	uint64_t lastFrameId = 0;
+	while ( true )
+	{
+		{
+			std::unique_lock< std::mutex > lock( mMutex );
+			mStartCondition.wait( lock, [ & ]() { return mQuit || ( mFrameId != lastFrameId ); } );
+			if ( mQuit )
+			{
+				return;
+			}
+			lastFrameId = mFrameId;
+		}
+
+		processBands();
+	}
+}
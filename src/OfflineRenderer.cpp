@@ -0,0 +1,194 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#include "OfflineRenderer.h"
+
+using namespace ci;
+
+namespace
+{
+
+//! WAVE_FORMAT_EXTENSIBLE header of IEEE float samples, fields in host (little-endian) byte order.
+struct WavHeader
+{
+	char mRiff[ 4 ];
+	uint32_t mRiffSize;
+	char mWave[ 4 ];
+
+	char mFmt[ 4 ];
+	uint32_t mFmtSize;
+	uint16_t mFormatTag;
+	uint16_t mNumChannels;
+	uint32_t mSampleRate;
+	uint32_t mByteRate;
+	uint16_t mBlockAlign;
+	uint16_t mBitsPerSample;
+	uint16_t mExtensionSize;
+	uint16_t mValidBitsPerSample;
+	uint32_t mChannelMask;
+	uint8_t mSubFormat[ 16 ];
+
+	char mFact[ 4 ];
+	uint32_t mFactSize;
+	uint32_t mNumFrames;
+
+	char mData[ 4 ];
+	uint32_t mDataSize;
+};
+
+static_assert( sizeof( WavHeader ) == 80, "unexpected WavHeader size" );
+
+WavHeader makeWavHeader( size_t numChannels, float sampleRate, uint64_t numFrames )
+{
+	// KSDATAFORMAT_SUBTYPE_IEEE_FLOAT
+	static const uint8_t kSubFormatFloat[ 16 ] =
+		{ 0x03, 0x00, 0x00, 0x00, 0x00, 0x00, 0x10, 0x00, 0x80, 0x00, 0x00, 0xaa, 0x00, 0x38, 0x9b, 0x71 };
+
+	WavHeader header;
+	const uint32_t dataSize = uint32_t( numFrames * numChannels * sizeof( float ) );
+	std::memcpy( header.mRiff, "RIFF", 4 );
+	header.mRiffSize = uint32_t( sizeof( WavHeader ) - 8 + dataSize );
+	std::memcpy( header.mWave, "WAVE", 4 );
+
+	std::memcpy( header.mFmt, "fmt ", 4 );
+	header.mFmtSize = 40;
+	header.mFormatTag = 0xfffe; // WAVE_FORMAT_EXTENSIBLE
+	header.mNumChannels = uint16_t( numChannels );
+	header.mSampleRate = uint32_t( sampleRate );
+	header.mByteRate = uint32_t( sampleRate * numChannels * sizeof( float ) );
+	header.mBlockAlign = uint16_t( numChannels * sizeof( float ) );
+	header.mBitsPerSample = 32;
+	header.mExtensionSize = 22;
+	header.mValidBitsPerSample = 32;
+	header.mChannelMask = 0; // no speaker positions, every metronome channel is a separate output
+	std::memcpy( header.mSubFormat, kSubFormatFloat, sizeof( kSubFormatFloat ) );
+
+	std::memcpy( header.mFact, "fact", 4 );
+	header.mFactSize = 4;
+	header.mNumFrames = uint32_t( numFrames );
+
+	std::memcpy( header.mData, "data", 4 );
+	header.mDataSize = dataSize;
+	return header;
+}
+
+} // anonymous namespace
+
+OfflineRenderer::Stats OfflineRenderer::render( const BpmTimeline &timeline, const fs::path &wavPath )
+{
+	const auto startTime = std::chrono::steady_clock::now();
+
+	const size_t numChannels = std::max< size_t >( mOptions.mNumChannels, 1 );
+	const size_t blockSize = std::max< size_t >( mOptions.mBlockSize, 1 );
+	const float sampleRate = mOptions.mSampleRate;
+	const size_t numVoices = timeline.getNumVoices();
+	const uint64_t numFrames = uint64_t( std::ceil( ( timeline.getDuration() + mOptions.mTail ) * sampleRate ) );
+	// the data chunk size is 32-bit
+	if ( numFrames * numChannels * sizeof( float ) > uint64_t( UINT32_MAX ) - sizeof( WavHeader ) )
+	{
+		throw ExcOfflineRender( "Timeline too long for a WAV file" );
+	}
+
+	FILE *file = nullptr;
+	bool written = true;
+	if ( ! wavPath.empty() )
+	{
+		file = std::fopen( wavPath.string().c_str(), "wb" );
+		if ( ! file )
+		{
+			throw ExcOfflineRender( "Could not create " + wavPath.string() );
+		}
+		const WavHeader header = makeWavHeader( numChannels, sampleRate, numFrames );
+		written = ( std::fwrite( &header, sizeof( header ), 1, file ) == 1 );
+	}
+
+	mSynth.setup( numVoices, sampleRate, numChannels );
+	mSynth.setMode( mOptions.mMode );
+	mSynth.restart();
+	if ( mOptions.mWindDown )
+	{
+		mEnsemble.setup( numVoices );
+		mEnsemble.setRunTime( mOptions.mRunTime );
+	}
+
+	std::vector< std::vector< float > > channelBuffers( numChannels, std::vector< float >( blockSize ) );
+	std::vector< float * > channels( numChannels );
+	for ( size_t ch = 0; ch < numChannels; ch++ )
+	{
+		channels[ ch ] = channelBuffers[ ch ].data();
+	}
+	std::vector< float > interleaved( blockSize * numChannels );
+
+	const auto &fields = timeline.getFields();
+	size_t nextField = 0;
+	uint64_t frame = 0;
+	while ( written && ( frame < numFrames ) )
+	{
+		// fields are applied at their sample, a block ends at the next field
+		while ( ( nextField < fields.size() ) && ( uint64_t( std::llround( fields[ nextField ].mTime * sampleRate ) ) <= frame ) )
+		{
+			const auto &bpm = fields[ nextField ].mBpm;
+			for ( size_t i = 0; i < bpm.size(); i++ )
+			{
+				mSynth.setVoice( i, MetronomeSynth::getBeatFrequency( float( bpm[ i ] ) ),
+								 MetronomeSynth::getCenterFrequency( float( bpm[ i ] ) ) );
+				if ( mOptions.mWindDown )
+				{
+					mEnsemble.setVoice( i, MetronomeSynth::getBeatFrequency( float( bpm[ i ] ) ) );
+				}
+			}
+			// the metronomes are wound once their first tempos are set
+			if ( mOptions.mWindDown && ( nextField == 0 ) )
+			{
+				mEnsemble.wind();
+			}
+			nextField++;
+		}
+
+		uint64_t blockEnd = std::min< uint64_t >( frame + blockSize, numFrames );
+		if ( nextField < fields.size() )
+		{
+			blockEnd = std::min< uint64_t >( blockEnd, uint64_t( std::llround( fields[ nextField ].mTime * sampleRate ) ) );
+		}
+		const size_t count = size_t( blockEnd - frame );
+
+		if ( mOptions.mWindDown )
+		{
+			mEnsemble.update( count / sampleRate );
+			mEnsemble.apply( &mSynth );
+		}
+		mSynth.process( channels.data(), count );
+
+		if ( file )
+		{
+			for ( size_t f = 0; f < count; f++ )
+			{
+				for ( size_t ch = 0; ch < numChannels; ch++ )
+				{
+					interleaved[ f * numChannels + ch ] = channels[ ch ][ f ];
+				}
+			}
+			written = ( std::fwrite( interleaved.data(), sizeof( float ) * numChannels, count, file ) == count );
+		}
+		frame = blockEnd;
+	}
+
+	if ( file )
+	{
+		written = ( std::fclose( file ) == 0 ) && written;
+	}
+	if ( ! written )
+	{
+		throw ExcOfflineRender( "Could not write " + wavPath.string() );
+	}
+
+	Stats stats;
+	stats.mNumFrames = numFrames;
+	stats.mRenderedSeconds = numFrames / double( sampleRate );
+	stats.mElapsedSeconds = std::chrono::duration< double >( std::chrono::steady_clock::now() - startTime ).count();
+	return stats;
+}
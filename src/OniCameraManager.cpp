@@ -1,4 +1,6 @@
 #include <algorithm>
+#include <utility>
+#include <vector>
 
 #include "cinder/Filesystem.h"
 #include "cinder/Json.h"
@@ -13,24 +15,71 @@
 
 using namespace ci;
 
+namespace {
+
+//! ImageTarget writing into the preallocated memory of an existing channel.
+template< typename T >
+class ImageTargetChannel : public ImageTarget
+{
+ public:
+	static std::shared_ptr< ImageTargetChannel > create( ChannelT< T > *channel )
+	{
+		return std::shared_ptr< ImageTargetChannel >( new ImageTargetChannel( channel ) );
+	}
+
+	bool hasAlpha() const override { return false; }
+	void * getRowPointer( int32_t row ) override { return mChannel->getData( ivec2( 0, row ) ); }
+
+ protected:
+	ImageTargetChannel( ChannelT< T > *channel ) : mChannel( channel )
+	{
+		setDataType( ( sizeof( T ) == 2 ) ? ImageIo::UINT16 : ImageIo::UINT8 );
+		setColorModel( ImageIo::CM_GRAY );
+		setChannelOrder( ImageIo::Y );
+	}
+
+	ChannelT< T > *mChannel;
+};
+
+} // anonymous namespace
+
 OniCameraManager::OniCameraManager()
 {
 	setupCameras();
 	setupParams();
 }
 
+OniCameraManager::DepthFrameQueue::DepthFrameQueue() :
+	mFreeFrames( kNumDepthFrames ),
+	mReadyFrames( kNumDepthFrames ),
+	mCaptureRunning( false ),
+	mNumDroppedFrames( 0 ),
+	mDepthNear( kDefaultDepthNear ),
+	mDepthFar( kDefaultDepthFar )
+{
+	// the last frame is held by the consumer thread initially
+	for ( size_t i = 0; i < kNumDepthFrames - 1; i++ )
+	{
+		mFreeFrames.push( i );
+	}
+}
+
 OniCameraManager::~OniCameraManager()
 {
+	stopRecording();
+
 	for ( auto &oc : mOniCameras )
 	{
-		if ( oc.mCapture )
+		if ( oc.mOpenThread )
 		{
-			oc.mCapture->stop();
+			oc.mOpenThread->join();
 		}
 
-		if ( oc.mOpenThread )
+		stopCaptureThread( oc );
+
+		if ( oc.mCapture )
 		{
-			oc.mOpenThread->join();
+			oc.mCapture->stop();
 		}
 	}
 
@@ -93,16 +142,31 @@ void OniCameraManager::startup()
 
 size_t OniCameraManager::getNumCameras()
 {
+	std::lock_guard< std::mutex > lock( mOniCamerasMutex );
 	return mOniCameras.size() - 1;
 }
 
 ChannelRef OniCameraManager::getCameraChannel( size_t i )
 {
-	return mOniCameras[ i + 1 ].mDepthChannel;
+	return getCameraFrame( i ).mChannel;
+}
+
+const OniCameraManager::DepthFrame & OniCameraManager::getCameraFrame( size_t i )
+{
+	static const DepthFrame sEmptyFrame;
+
+	std::lock_guard< std::mutex > lock( mOniCamerasMutex );
+	const auto &cam = mOniCameras[ i + 1 ];
+	if ( ! cam.mDepthFrameQueue )
+	{
+		return sEmptyFrame;
+	}
+	return cam.mDepthFrameQueue->mFrames[ cam.mDepthFrameId ];
 }
 
 std::string OniCameraManager::getCameraLabel( size_t i )
 {
+	std::lock_guard< std::mutex > lock( mOniCamerasMutex );
 	return mOniCameras[ i + 1 ].mLabel;
 }
 
@@ -129,6 +193,7 @@ void OniCameraManager::setupParams()
 	mParams->addParam( "Camera", cameraNames, &mOniCameraId );
 	mParams->addParam( "Camera resolution", { "320x240", "640x480" },
 						reinterpret_cast< int * >( &mCameraResolutionId ) );
+	mParams->addParam( "Depth band segmentation", &mDepthBandEnabled );
 
 	mParams->addButton( "Open camera", [ this ]()
 			{
@@ -165,21 +230,254 @@ void OniCameraManager::setupParams()
 	mParams->addSeparator();
 
 	mParams->addParam( "Camera debug", &mDebugDraw );
+	mParams->addParam( "Ring full frames", &mRingDroppedFrames, true );
+	mParams->addSeparator();
+
+	mParams->addButton( "Start recording", [ this ]()
+			{
+				fs::path appPath = app::getAppPath();
+#ifdef CINDER_MAC
+				appPath = appPath.parent_path();
+#endif
+				fs::path savePath = app::getSaveFilePath( appPath );
+				if ( ! savePath.empty() )
+				{
+					startRecording( savePath );
+				}
+			} );
+	mParams->addButton( "Stop recording", [ this ]()
+			{
+				stopRecording();
+			} );
+	mParams->addParam( "Recorded frames", &mRecordedFrames, true );
+	mParams->addParam( "Dropped frames", &mDroppedFrames, true );
+	mParams->addParam( "Recording MB/s", &mRecordingThroughput, true );
+	mParams->addParam( "Compression ratio", &mRecordingCompressionRatio, true );
 
 	GlobalData &gd = GlobalData::get();
 	gd.mConfig->addVar( "CameraManager.ConfigPath", &mLastCameraConfig, "" );
 	gd.mConfig->addVar( "CameraManager.LoadAtStartup", &mLoadCameraConfigAtStart, false );
+	gd.mConfig->addVar( "CameraManager.DepthBand", &mDepthBandEnabled, false );
 }
 
 void OniCameraManager::update()
 {
+	std::lock_guard< std::mutex > lock( mOniCamerasMutex );
+
+	uint64_t ringDroppedFrames = 0;
+	for ( auto &cam : mOniCameras )
+	{
+		if ( ! cam.mDepthFrameQueue )
+		{
+			continue;
+		}
+		ringDroppedFrames += cam.mDepthFrameQueue->mNumDroppedFrames;
+
+		// keep the freshest published frame, recycle the previous ones
+		size_t frameId;
+		bool newFrame = false;
+		while ( cam.mDepthFrameQueue->mReadyFrames.pop( &frameId ) )
+		{
+			cam.mDepthFrameQueue->mFreeFrames.push( cam.mDepthFrameId );
+			cam.mDepthFrameId = frameId;
+			newFrame = true;
+		}
+
+		// the frame will be recycled while draw() might still use it, so the debug view gets a copy
+		const ChannelRef &depthChannel = cam.mDepthFrameQueue->mFrames[ cam.mDepthFrameId ].mChannel;
+		if ( mDebugDraw && newFrame && depthChannel )
+		{
+			// draw() may still be uploading the previous copy outside of the lock
+			if ( ! cam.mDebugChannel || ( cam.mDebugChannel->getSize() != depthChannel->getSize() ) ||
+				 ( cam.mDebugChannel.use_count() > 1 ) )
+			{
+				cam.mDebugChannel = Channel::create( depthChannel->getWidth(), depthChannel->getHeight() );
+			}
+			cam.mDebugChannel->copyFrom( *depthChannel, depthChannel->getBounds() );
+		}
+	}
+
+	mRingDroppedFrames = static_cast< int >( ringDroppedFrames );
+
+	if ( mRecorder )
+	{
+		DepthRecorder::Stats stats = mRecorder->getStats();
+		mRecordedFrames = static_cast< int >( stats.mNumFrames );
+		mDroppedFrames = static_cast< int >( stats.mNumDroppedFrames );
+		mRecordingThroughput = static_cast< float >( stats.getThroughput() );
+		mRecordingCompressionRatio = static_cast< float >( stats.getCompressionRatio() );
+	}
+}
+
+void OniCameraManager::startRecording( const fs::path &path )
+{
+	stopRecording();
+
+	std::lock_guard< std::mutex > lock( mOniCamerasMutex );
+
+	// cameras are recorded at the size of their latest frame
+	std::vector< DepthRecordingWriter::Camera > cameras;
+	std::vector< DepthFrameQueue * > queues;
 	for ( auto &cam : mOniCameras )
 	{
-		if ( cam.mCapture && cam.mCapture->checkNewDepthFrame() )
+		if ( ! cam.mCaptureThread )
+		{
+			continue;
+		}
+		const ChannelRef &depthChannel = cam.mDepthFrameQueue->mFrames[ cam.mDepthFrameId ].mChannel;
+		if ( depthChannel )
+		{
+			// the frames only hold the band mask, the raw depth is recorded to tune the band on replay
+			const depthrecording::PixelFormat pixelFormat = cam.mDepthFrameQueue->mDepthBandEnabled ?
+				depthrecording::PIXEL_FORMAT_DEPTH16 : depthrecording::PIXEL_FORMAT_DEPTH8;
+			cameras.push_back( { depthChannel->getSize(), cam.mLabel, pixelFormat } );
+			queues.push_back( cam.mDepthFrameQueue.get() );
+		}
+	}
+
+	if ( cameras.empty() )
+	{
+		CI_LOG_W( "No camera frames to record" );
+		return;
+	}
+
+	try
+	{
+		mRecorder = DepthRecorder::create( path, cameras );
+	}
+	catch ( const depthrecording::ExcDepthRecording &exc )
+	{
+		CI_LOG_E( exc.what() );
+		return;
+	}
+
+	for ( size_t i = 0; i < queues.size(); i++ )
+	{
+		queues[ i ]->mRecorderCameraId = i;
+		std::atomic_store( &queues[ i ]->mRecorder, mRecorder );
+	}
+	CI_LOG_I( "Recording " << cameras.size() << " cameras to " << path.string() );
+}
+
+void OniCameraManager::stopRecording()
+{
+	DepthRecorderRef recorder;
+	{
+		std::lock_guard< std::mutex > lock( mOniCamerasMutex );
+		for ( auto &cam : mOniCameras )
+		{
+			if ( cam.mDepthFrameQueue )
+			{
+				std::atomic_store( &cam.mDepthFrameQueue->mRecorder, DepthRecorderRef() );
+			}
+		}
+		recorder.swap( mRecorder );
+	}
+
+	if ( recorder )
+	{
+		// writes the frames still in the queue
+		recorder->stop();
+
+		DepthRecorder::Stats stats = recorder->getStats();
+		CI_LOG_I( "Recorded " << stats.mNumFrames << " frames, dropped " << stats.mNumDroppedFrames <<
+				  ", " << stats.getThroughput() << " MB/s, compression ratio " << stats.getCompressionRatio() );
+	}
+}
+
+void OniCameraManager::captureThreadFn( mndl::oni::OniCaptureRef capture, DepthFrameQueueRef queue )
+{
+	while ( queue->mCaptureRunning )
+	{
+		if ( capture->checkNewDepthFrame() )
+		{
+			storeDepthFrame( queue.get(), capture->getDepthImage() );
+		}
+		else
+		{
+			ci::sleep( 1.0f );
+		}
+	}
+}
+
+void OniCameraManager::stopCaptureThread( OniCamera &cam )
+{
+	if ( cam.mCaptureThread )
+	{
+		cam.mDepthFrameQueue->mCaptureRunning = false;
+		cam.mCaptureThread->join();
+		cam.mCaptureThread.reset();
+	}
+}
+
+bool OniCameraManager::storeDepthFrame( DepthFrameQueue *queue, const ImageSourceRef &image )
+{
+	// the recorder gets every frame, even the ones the consumer thread has no slot for
+	DepthRecorderRef recorder = std::atomic_load( &queue->mRecorder );
+	size_t frameId;
+	const bool stored = queue->mFreeFrames.pop( &frameId );
+	if ( ! stored )
+	{
+		// the consumer thread has not caught up yet
+		queue->mNumDroppedFrames++;
+		if ( ! recorder )
+		{
+			return false;
+		}
+	}
+
+	ChannelRef &channel = stored ? queue->mFrames[ frameId ].mChannel : queue->mRecordChannel;
+
+	// the ring slots are only allocated for the first frames or when the camera resolution changes
+	if ( ! channel || ( channel->getWidth() != image->getWidth() ) ||
+		 ( channel->getHeight() != image->getHeight() ) )
+	{
+		channel = Channel::create( image->getWidth(), image->getHeight() );
+	}
+
+	if ( queue->mDepthBandEnabled )
+	{
+		// raw millimetre depth is kept in 16 bits and segmented straight into the frame's mask
+		if ( ! queue->mRawDepth || ( queue->mRawDepth->getSize() != channel->getSize() ) )
+		{
+			queue->mRawDepth = Channel16u::create( image->getWidth(), image->getHeight() );
+		}
+		image->load( ImageTargetChannel< uint16_t >::create( queue->mRawDepth.get() ) );
+		// the recorder takes the raw depth, the mask is only needed for the ring
+		if ( stored )
 		{
-			cam.mDepthChannel = Channel::create( cam.mCapture->getDepthImage() );
+			depthrecording::depthBandMask( *queue->mRawDepth, queue->mDepthNear, queue->mDepthFar, channel.get() );
 		}
 	}
+	else
+	{
+		image->load( ImageTargetChannel< uint8_t >::create( channel.get() ) );
+	}
+	const uint64_t sequence = ++queue->mSequence;
+	const double timestamp = app::getElapsedSeconds();
+
+	if ( stored )
+	{
+		DepthFrame &frame = queue->mFrames[ frameId ];
+		frame.mSequence = sequence;
+		frame.mTimestamp = timestamp;
+		frame.mDepthBand = queue->mDepthBandEnabled;
+		queue->mReadyFrames.push( frameId );
+	}
+
+	// the recorder takes a copy, the capture thread never waits for the disk
+	if ( recorder )
+	{
+		if ( queue->mDepthBandEnabled )
+		{
+			recorder->addFrame( queue->mRecorderCameraId, sequence, timestamp, *queue->mRawDepth );
+		}
+		else
+		{
+			recorder->addFrame( queue->mRecorderCameraId, sequence, timestamp, *channel );
+		}
+	}
+	return stored;
 }
 
 void OniCameraManager::draw()
@@ -193,22 +491,34 @@ void OniCameraManager::draw()
 	vec2 offset( margin );
 	float offsetY = margin;
 
-	for ( auto &cam : mOniCameras )
+	// the frames are copied for the debug view, so only the refs are taken under the lock
+	// and the textures are uploaded without holding up the pipeline
+	std::vector< std::pair< ChannelRef, std::string > > debugChannels;
 	{
-		if ( cam.mDepthChannel )
+		std::lock_guard< std::mutex > lock( mOniCamerasMutex );
+		for ( const auto &cam : mOniCameras )
 		{
-			Rectf rect = cam.mDepthChannel->getBounds();
-			if ( rect.getX2() + offset.x > app::getWindowWidth() )
+			if ( cam.mDebugChannel )
 			{
-				offset = vec2( margin, offsetY + margin + rect.getY2() );
+				debugChannels.push_back( std::make_pair( cam.mDebugChannel, cam.mLabel ) );
 			}
+		}
+	}
 
-			rect.offset( offset );
-			gl::draw( gl::Texture2d::create( *cam.mDepthChannel ), rect );
-			gl::drawString( cam.mLabel, offset + vec2( margin ) );
-
-			offset.x += rect.getWidth() + margin;
+	for ( const auto &debugChannel : debugChannels )
+	{
+		const ChannelRef &depthChannel = debugChannel.first;
+		Rectf rect = depthChannel->getBounds();
+		if ( rect.getX2() + offset.x > app::getWindowWidth() )
+		{
+			offset = vec2( margin, offsetY + margin + rect.getY2() );
 		}
+
+		rect.offset( offset );
+		gl::draw( gl::Texture2d::create( *depthChannel ), rect );
+		gl::drawString( debugChannel.second, offset + vec2( margin ) );
+
+		offset.x += rect.getWidth() + margin;
 	}
 }
 
@@ -219,6 +529,18 @@ void OniCameraManager::addCameraParams( size_t cameraId )
 	auto sepName = name + "-sep";
 	mParams->addSeparator( sepName );
 	mParams->addParam( name + " progress", &cam.mProgressMessage, true ).group( name );
+	mParams->addParam( name + " near (mm)", &cam.mDepthNear ).min( 0 ).max( 10000 ).step( 10 ).
+		group( name ).updateFn( [ this, cameraId ]()
+			{
+				auto &cam = mOniCameras[ cameraId ];
+				cam.mDepthFrameQueue->mDepthNear = cam.mDepthNear;
+			} );
+	mParams->addParam( name + " far (mm)", &cam.mDepthFar ).min( 0 ).max( 10000 ).step( 10 ).
+		group( name ).updateFn( [ this, cameraId ]()
+			{
+				auto &cam = mOniCameras[ cameraId ];
+				cam.mDepthFrameQueue->mDepthFar = cam.mDepthFar;
+			} );
 }
 
 void OniCameraManager::setupOpenCamera( size_t cameraId )
@@ -226,6 +548,15 @@ void OniCameraManager::setupOpenCamera( size_t cameraId )
 	if ( ( cameraId > 0 ) && ( cameraId < mOniCameras.size() ) )
 	{
 		auto &cam = mOniCameras[ cameraId ];
+		if ( ! cam.mDepthFrameQueue )
+		{
+			std::lock_guard< std::mutex > lock( mOniCamerasMutex );
+			cam.mDepthFrameQueue = std::make_shared< DepthFrameQueue >();
+			cam.mDepthFrameId = DepthFrameQueue::kNumDepthFrames - 1;
+		}
+		cam.mDepthFrameQueue->mDepthNear = cam.mDepthNear;
+		cam.mDepthFrameQueue->mDepthFar = cam.mDepthFar;
+
 		if ( cam.mOpenThread )
 		{
 			cam.mOpenThread->join();
@@ -257,6 +588,8 @@ void OniCameraManager::openOniCameraThreadFn( size_t cameraId )
 
 	cam.mProgressMessage = "Connecting...";
 
+	stopCaptureThread( cam );
+
 	if ( cam.mCapture )
 	{
 		cam.mCapture->stop();
@@ -280,10 +613,20 @@ void OniCameraManager::openOniCameraThreadFn( size_t cameraId )
 	depthMode.setFps( 30 );
 	depthMode.setPixelFormat( openni::PIXEL_FORMAT_DEPTH_1_MM );
 	cam.mCapture->getDepthStreamRef()->setVideoMode( depthMode );
-	cam.mCapture->invertDepth();
+	// the depth band needs the raw millimetre values
+	cam.mDepthFrameQueue->mDepthBandEnabled = mDepthBandEnabled;
+	if ( ! mDepthBandEnabled )
+	{
+		cam.mCapture->invertDepth();
+	}
 
 	cam.mProgressMessage = "Connected";
 	cam.mCapture->start();
+
+	cam.mDepthFrameQueue->mCaptureRunning = true;
+	cam.mCaptureThread =
+		std::shared_ptr< std::thread >( new std::thread(
+			std::bind( &OniCameraManager::captureThreadFn, this, cam.mCapture, cam.mDepthFrameQueue ) ) );
 }
 
 size_t OniCameraManager::findCameraId( const std::string &serial )
@@ -323,9 +666,17 @@ void OniCameraManager::readCameraConfig( const ci::DataSourceRef &source )
 			oniCam.mName = name;
 			oniCam.mUri = uri;
 			oniCam.mSerial = serial;
+
+			std::lock_guard< std::mutex > lock( mOniCamerasMutex );
 			mOniCameras.push_back( oniCam );
 		}
 
+		if ( cameraData.hasChild( "depthNear" ) && cameraData.hasChild( "depthFar" ) )
+		{
+			mOniCameras[ cameraId ].mDepthNear = cameraData.getValueForKey< int >( "depthNear" );
+			mOniCameras[ cameraId ].mDepthFar = cameraData.getValueForKey< int >( "depthFar" );
+		}
+
 		setupOpenCamera( cameraId );
 		// NOTE: without this sleep a missing camera can lock the opening of
 		// some of the existing cameras for some unknown reason
@@ -350,6 +701,8 @@ void OniCameraManager::writeCameraConfig( const ci::DataTargetRef &target )
 		cameraData.pushBack( JsonTree( "name", cam.mName ) );
 		cameraData.pushBack( JsonTree( "uri", cam.mUri ) );
 		cameraData.pushBack( JsonTree( "serial", cam.mSerial ) );
+		cameraData.pushBack( JsonTree( "depthNear", cam.mDepthNear ) );
+		cameraData.pushBack( JsonTree( "depthFar", cam.mDepthFar ) );
 		cameras.pushBack( cameraData );
 	}
 	doc.pushBack( cameras );
@@ -8,57 +8,42 @@ using namespace std;
 
 Sound::Sound(){};
 
-void Sound::setup( audio::Context &ctx ) {
+void Sound::setup( audio::Context &ctx, int numVoices ) {
 
     GlobalData &gd = GlobalData::get();
-    int num = gd.mGridSize * gd.mGridSize;
+    int num = ( numVoices > 0 ) ? numVoices : gd.mGridSize * gd.mGridSize;
     
-    for( int i = 0; i < num; i++ ) {
-        ci::audio::GenNodeRef gen;
-        ci::audio::FilterBandPassNodeRef filt;
-        ci::audio::GainNodeRef gain;
-        
-        gen = ctx.makeNode( new audio::GenPhasorNode );
-        gen->setFreq( 1 );
-        
-        filt = ctx.makeNode( new audio::FilterBandPassNode );
-        filt->setQ( 4 );
-        filt->setGain( 1.0f );
-        filt->enable();
-        
-        gain = ctx.makeNode( new audio::GainNode );
-        
-        gen >> filt >> gain >> ctx.getOutput();
-        gen->enable();
-        
-        gain->setValue( 0.1f );
-        gain->enable();
-        
-        mPhasorGens.push_back( gen );
-        mGains.push_back( gain );
-        mFilters.push_back( filt );
-    }
+    mSynth = ctx.makeNode( new MetronomeSynthNode( num ) );
+    mSynth >> ctx.getOutput();
+    mSynth->enable();
+
+    mFreqs.assign( num, 1.0f );
+    mCenterFreqs.assign( num, 0.0f );
+    mSynth->setVoiceFrequencies( mFreqs, mCenterFreqs );
 }
 
-void Sound::update( vector< int > bpmVals ) {
-    for( int i = 0; i < mPhasorGens.size(); i++ ) {
-        if( i < bpmVals.size() ) {
-            float hertz = 1000 / ( 60000 / ( float )bpmVals[i] );
-            mPhasorGens[i]->setFreq( hertz );
-            mFilters[i]->setCenterFreq( bpmVals[i] * 40 );
+void Sound::update( const vector< int > &bpmVals ) {
+    // the audio thread is only handed a new block if a frequency has changed
+    bool changed = false;
+    // voices beyond the grid repeat its bpm values
+    for( int i = 0; i < mFreqs.size(); i++ ) {
+        if( ! bpmVals.empty() ) {
+            int bpm = bpmVals[i % bpmVals.size()];
+            float hertz = MetronomeSynth::getBeatFrequency( bpm );
+            float centerFreq = MetronomeSynth::getCenterFrequency( bpm );
+            changed = changed || ( hertz != mFreqs[i] ) || ( centerFreq != mCenterFreqs[i] );
+            mFreqs[i] = hertz;
+            mCenterFreqs[i] = centerFreq;
         }
     }
+    if( changed ) {
+        mSynth->setVoiceFrequencies( mFreqs, mCenterFreqs );
+    }
 }
 
 void Sound::draw() {
 }
 
 void Sound::sync() {
-    for( auto gen : mPhasorGens ) {
-        gen->setPhase(0);
-    }
+    mSynth->resetPhases();
 }
-
-
-
-